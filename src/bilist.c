@@ -1,5 +1,8 @@
+#include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 
 #define REDISMODULE_EXPERIMENTAL_API
@@ -7,55 +10,301 @@
 #include "../redis/src/redismodule.h"
 
 #include "skiplist.h"
+#include "heap.h"
+#include "sarray.h"
+#include "pool.h"
+#include "htable.h"
+#include "bloom.h"
 #include "prand.h"
 
 #define BILIST_MAX_COUNTER_INCREMENT 0X4c
 
-#define BILIST_TIMER_PERIOD 1000
+#define BILIST_TIMER_PERIOD 100
 #define BILIST_PRUNE_SIZE 20
-#define BILIST_PRUNE_TRESHOLD 5
+#define BILIST_EXPIRE_BUDGET 1000   // Microseconds of active expiry per timer tick
+
+#define BILIST_SCAN_COUNT 10
+#define BILIST_COMPACT_ENTRIES 32
+#define BILIST_DEFRAG_BATCH 16      // Binodes moved between time checks
+#define BILIST_AOF_BATCH 64         // Pairs per command in AOF rewrites
+#define BILIST_FILTER_MIN 64        // Pairs a new filter has room for at least
+#define BILIST_WALK_DEPTH 8         // Largest DEPTH of bilist.walk
+#define BILIST_WALK_PAIRS 1000000   // Pairs a bilist.walk may read
+
+#define BILIST_ENCODING_VERSION 1   // RDB encoding written, 0 can still be loaded
 
 static RedisModuleType *bilist_type;
 
+static long long bilist_expire_budget = BILIST_EXPIRE_BUDGET;
+static long long bilist_compact_entries = BILIST_COMPACT_ENTRIES;
+static long long bilist_defer_secondary = 0;
+static long long bilist_hash_index = 0;
+static u_int64_t bilist_hash_seed;
+
+static long long bilist_filter_fp = 0;          // False positives per million, 0: no filters
+static long long bilist_filter_max_bytes = 0;
+static u_int32_t bilist_filter_bits;            // Per entry, from bilist_filter_fp
+static u_int32_t bilist_filter_probes;
+static long long bilist_filter_checks;
+static long long bilist_filter_negatives;
+
+/*
+ * A pair and its value are stored in one allocation: key1, key2 and value
+ * follow the header. The skip list nodes of both indexes point into it
+ * instead of keeping copies of the keys.
+ */
 struct binode
 {
-    RedisModuleString *key1;
-    RedisModuleString *key2;
-    RedisModuleString *value;
-    long long expire_time;
+    struct h_node expire;       // expire.when == 0: never expires
     struct binode *next;
     struct binode *prev;
+    u_int32_t key1_len;
+    u_int32_t key2_len;
+    u_int32_t value_len;
+    char data[];
 };
 
+#define BINODE_KEY1(N) ((N)->data)
+#define BINODE_KEY2(N) ((N)->data + (N)->key1_len)
+#define BINODE_VALUE(N) (BINODE_KEY2(N) + (N)->key2_len)
+#define BINODE_SIZE(N) (sizeof(struct binode) + (N)->key1_len + (N)->key2_len + (N)->value_len)
+#define BINODE_FROM_EXPIRE(H) ((struct binode *)((char *)(H) - offsetof(struct binode, expire)))
+
+#define BILIST_COMPACT(B) ((B)->primary_slist == NULL)
+#define BILIST_HASHED(B) ((B)->table.slots != NULL)
+#define BILIST_FILTERED(B) ((B)->filter.bits != NULL)
+
+/*
+ * Small bilists keep both indexes as sorted arrays (compact encoding) and
+ * have no skip lists. Once they grow past bilist_compact_entries pairs
+ * they are expanded to skip lists for good.
+ *
+ * Binodes and skip list nodes are allocated from the pool of the bilist,
+ * so freeing a bilist releases a few slabs instead of every pair.
+ *
+ * With hash-index, skip list bilists also find their binodes by pair in a
+ * hash table, for the lookups that need no order. With filter-fp they keep
+ * a Bloom filter of their key1s, key2s and pairs, which answers most
+ * lookups of missing keys without a search.
+ */
 struct bilist
 {
     struct s_list * primary_slist;
     struct s_list * secondary_slist;
 
+    struct s_array primary_array;
+    struct s_array secondary_array;
+
+    struct t_table table;
+
+    struct b_filter filter;
+    unsigned long filter_capacity;  // Pairs the filter was sized for
+    unsigned long filter_deleted;   // Pairs deleted since it was built
+
+    struct pool pool;
+
     u_int32_t counter;
     u_int8_t increment;
-    u_int8_t timer_active;
+    u_int8_t scheduled;
+    u_int8_t secondary_pending; // Loaded with defer-secondary, secondary index still empty
 
     unsigned long items;
+    u_int64_t version;          // Bumped on every change to the pairs
 
     struct prand prand;
 
     struct binode *first;
 
-    struct binode *next_prune;
+    struct h_heap expires;      // Binodes with an expire time, soonest first
 
-    RedisModuleTimerID timer_id;
+    struct bilist *expire_next; // Scheduler list of bilists with expiring pairs
+    struct bilist *expire_prev;
 
+    struct binode *defrag_next; // Next binode to move while the pool is evacuated
+
+    RedisModuleString *name;    // Key and database, to replicate expired pairs
+    int db;
 };
 
+/*
+ * Module wide expiry scheduler: one timer walks the bilists that hold
+ * expiring pairs round robin, spending at most bilist_expire_budget
+ * microseconds per tick.
+ */
+static struct bilist *expire_first;
+static struct bilist *expire_cursor;
+static unsigned long expire_lists;
+
+u_int64_t bilist_hash(const struct s_key *key)
+{
+    return table_hash(bilist_hash_seed, key->primary_key, key->primary_len, key->secondary_key, key->secondary_len);
+}
+
+u_int64_t bilist_node_hash(const struct binode *binode)
+{
+    return table_hash(bilist_hash_seed, BINODE_KEY1(binode), binode->key1_len, BINODE_KEY2(binode), binode->key2_len);
+}
+
+int bilist_node_match(const void *data, const void *key)
+{
+    const struct binode *binode = data;
+    const struct s_key *pair = key;
+
+    return binode->key1_len == pair->primary_len && binode->key2_len == pair->secondary_len &&
+        memcmp(BINODE_KEY1(binode), pair->primary_key, pair->primary_len) == 0 &&
+        memcmp(BINODE_KEY2(binode), pair->secondary_key, pair->secondary_len) == 0;
+}
+
+/*
+ * Hash of a key1 (secondary 0) or key2 (secondary 1) in the filter. Pairs
+ * are in the filter with their bilist_hash.
+ */
+u_int64_t bilist_partner_hash(const char *key, size_t len, int secondary)
+{
+    return table_hash(bilist_hash_seed + 1 + secondary, key, len, NULL, 0);
+}
+
+void bilist_filter_node(struct bilist *bilist, struct binode *binode)
+{
+    bloom_add(&(bilist->filter), bilist_node_hash(binode));
+    bloom_add(&(bilist->filter), bilist_partner_hash(BINODE_KEY1(binode), binode->key1_len, 0));
+    bloom_add(&(bilist->filter), bilist_partner_hash(BINODE_KEY2(binode), binode->key2_len, 1));
+}
+
+/*
+ * (Re)builds the filter from the binode list, with room for twice the
+ * pairs in the bilist
+ */
+void bilist_build_filter(struct bilist *bilist)
+{
+    struct binode *binode;
+    unsigned long capacity;
+    u_int64_t bits, limit;
+
+    capacity = bilist->items * 2;
+    if (capacity < BILIST_FILTER_MIN)
+        capacity = BILIST_FILTER_MIN;
+    bits = (u_int64_t)capacity * 3 * bilist_filter_bits;
+
+    // bloom_create rounds up to a power of 2, so the limit is rounded down
+    if (bilist_filter_max_bytes) {
+        for (limit = B_MIN_BITS; limit * 2 <= (u_int64_t)bilist_filter_max_bytes * 8; limit *= 2)
+            ;
+        if (bits > limit)
+            bits = limit;
+    }
+
+    bloom_free(&(bilist->filter));
+    bloom_create(&(bilist->filter), bits, bilist_filter_probes);
+    bilist->filter_capacity = capacity;
+    bilist->filter_deleted = 0;
+
+    for (binode = bilist->first; binode; binode = binode->next)
+        bilist_filter_node(bilist, binode);
+}
+
+/*
+ * Whether the filter lets hash through
+ */
+int bilist_filter_check(struct bilist *bilist, u_int64_t hash)
+{
+    bilist_filter_checks++;
+    if (bloom_check(&(bilist->filter), hash))
+        return 1;
+    bilist_filter_negatives++;
+    return 0;
+}
+
+/*
+ * 0 if key has no partners in the index, 1 if it may have
+ */
+int bilist_filter_partners(struct bilist *bilist, const struct s_key *key, int secondary)
+{
+    if (!BILIST_FILTERED(bilist))
+        return 1;
+    return bilist_filter_check(bilist, bilist_partner_hash(key->primary_key, key->primary_len, secondary));
+}
+
+/*
+ * Adds a binode, just indexed, to the hash table and the filter of the
+ * bilist. bilist->items does not count it yet.
+ */
+void bilist_hash_node(struct bilist *bilist, struct binode *binode)
+{
+    if (BILIST_HASHED(bilist))
+        table_insert(&(bilist->table), bilist_node_hash(binode), binode);
+    if (BILIST_FILTERED(bilist)) {
+        if (bilist->items >= bilist->filter_capacity)
+            bilist_build_filter(bilist);
+        else
+            bilist_filter_node(bilist, binode);
+    }
+}
+
+/*
+ * Takes a binode about to be deleted out of the hash table. Its bits stay
+ * in the filter until the next rebuild, which clears them once the deleted
+ * pairs outnumber the live ones. The rebuild still sees the binode, and
+ * those of the same command not deleted yet: a few bits stay set.
+ */
+void bilist_unhash_node(struct bilist *bilist, struct binode *binode)
+{
+    if (BILIST_HASHED(bilist))
+        table_delete(&(bilist->table), bilist_node_hash(binode), binode);
+    if (BILIST_FILTERED(bilist) && ++bilist->filter_deleted > bilist->items)
+        bilist_build_filter(bilist);
+}
+
+/*
+ * Moves a compact bilist to skip lists, and to the hash table with
+ * hash-index and the filter with filter-fp. Both are sized for
+ * bilist->items.
+ */
+void bilist_expand(struct bilist *bilist)
+{
+    u_int32_t i;
+    struct binode *binode;
+
+    if (!BILIST_COMPACT(bilist))
+        return;
+
+    if (bilist_hash_index) {
+        table_reserve(&(bilist->table), bilist->items);
+        for (i = 0; i < bilist->primary_array.size; i++) {
+            binode = bilist->primary_array.entries[i].data;
+            table_insert(&(bilist->table), bilist_node_hash(binode), binode);
+        }
+    }
+    if (bilist_filter_fp)
+        bilist_build_filter(bilist);
+
+    bilist->primary_slist = slist_create(&(bilist->pool));
+    bilist->secondary_slist = slist_create(&(bilist->pool));
+
+    for (i = 0; i < bilist->primary_array.size; i++)
+        slist_insert(bilist->primary_slist, &(bilist->primary_array.entries[i].key), bilist->primary_array.entries[i].data);
+    for (i = 0; i < bilist->secondary_array.size; i++)
+        slist_insert(bilist->secondary_slist, &(bilist->secondary_array.entries[i].key), bilist->secondary_array.entries[i].data);
+
+    sarray_free(&(bilist->primary_array));
+    sarray_free(&(bilist->secondary_array));
+}
+
 struct bilist *bilist_create()
 {
     struct bilist *bilist;
 
     bilist = RedisModule_Alloc(sizeof(struct bilist));
 
-    bilist->primary_slist = slist_create();
-    bilist->secondary_slist = slist_create();
+    pool_init(&(bilist->pool));
+    bilist->primary_slist = NULL;
+    bilist->secondary_slist = NULL;
+    sarray_init(&(bilist->primary_array));
+    sarray_init(&(bilist->secondary_array));
+    table_init(&(bilist->table));
+    bloom_init(&(bilist->filter));
+    bilist->filter_capacity = 0;
+    bilist->filter_deleted = 0;
 
     pseed(&(bilist->prand), time(NULL));
 
@@ -63,75 +312,111 @@ struct bilist *bilist_create()
     bilist->increment = prand32(&(bilist->prand)) % BILIST_MAX_COUNTER_INCREMENT;
 
     bilist->items = 0;
+    bilist->version = 0;
     bilist->first = NULL;
-    bilist->next_prune = NULL;
+    heap_init(&(bilist->expires));
 
-    bilist->timer_id = 0;
-    bilist->timer_active = 0;
+    bilist->scheduled = 0;
+    bilist->secondary_pending = 0;
+    bilist->expire_next = NULL;
+    bilist->expire_prev = NULL;
+    bilist->defrag_next = NULL;
+    bilist->name = NULL;
+    bilist->db = 0;
+
+    if (bilist_compact_entries == 0)
+        bilist_expand(bilist);
 
     return bilist;
 }
 
-void bilist_data_free(struct binode *datanode)
+void bilist_data_free(struct bilist *bilist, struct binode *datanode)
 {
     if (datanode == NULL)
         return;
-    RedisModule_FreeString(NULL, datanode->key1);
-    RedisModule_FreeString(NULL, datanode->key2);
-    RedisModule_FreeString(NULL, datanode->value);
-    RedisModule_Free(datanode);
+    pool_free(&(bilist->pool), datanode, BINODE_SIZE(datanode));
 }
 
-void bilist_release(struct bilist *bilist)
+void bilist_schedule(struct bilist *bilist)
 {
-    struct binode *node;
-
-    if (bilist == NULL)
+    if (bilist->scheduled)
         return;
-    slist_free(bilist->primary_slist);
-    slist_free(bilist->secondary_slist);
-
-    for (node = bilist->first; node; ) {
-        struct binode *tmp = node->next;
-        bilist_data_free(node);
-        node = tmp;
-    }
-    FREE(bilist);
+    bilist->expire_prev = NULL;
+    bilist->expire_next = expire_first;
+    if (expire_first)
+        expire_first->expire_prev = bilist;
+    expire_first = bilist;
+    expire_lists++;
+    bilist->scheduled = 1;
 }
 
-struct bilist *bilist_get_from_key(RedisModuleCtx *ctx, RedisModuleString *keyname)
+void bilist_unschedule(struct bilist *bilist)
 {
-    struct bilist *bilist;
-    RedisModuleKey *key;
-    int type;
-
-    key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
-
-    type = RedisModule_KeyType(key);
+    if (!bilist->scheduled)
+        return;
+    if (expire_cursor == bilist)
+        expire_cursor = bilist->expire_next;
+    if (bilist->expire_prev)
+        bilist->expire_prev->expire_next = bilist->expire_next;
+    else
+        expire_first = bilist->expire_next;
+    if (bilist->expire_next)
+        bilist->expire_next->expire_prev = bilist->expire_prev;
+    expire_lists--;
+    bilist->scheduled = 0;
+}
 
-    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != bilist_type) {
-        return NULL;
+/*
+ * Remembers where the bilist is stored. Writes and RENAME or MOVE keep it
+ * current, expired pairs are replicated as deletes from this key. A bilist
+ * with pairs to expire goes back on the scheduler here, as async flushes
+ * take off those they cannot place.
+ */
+void bilist_set_name(struct bilist *bilist, const RedisModuleString *keyname, int db)
+{
+    const char *name, *current;
+    size_t len, current_len;
+
+    name = RedisModule_StringPtrLen(keyname, &len);
+    if (bilist->name && bilist->db == db) {
+        current = RedisModule_StringPtrLen(bilist->name, &current_len);
+        if (current_len == len && memcmp(current, name, len) == 0)
+            return;
     }
+    if (bilist->name)
+        RedisModule_FreeString(NULL, bilist->name);
+    bilist->name = RedisModule_CreateString(NULL, name, len);
+    bilist->db = db;
 
-    if (type == REDISMODULE_KEYTYPE_EMPTY) {
-        bilist = bilist_create();
-        RedisModule_ModuleTypeSetValue(key, bilist_type, bilist);
-    } else {
-        bilist = RedisModule_ModuleTypeGetValue(key);
-    }
-    RedisModule_CloseKey(key);
+    if (heap_top(&(bilist->expires)))
+        bilist_schedule(bilist);
+}
 
-    return bilist;
+void bilist_release(struct bilist *bilist)
+{
+    if (bilist == NULL)
+        return;
+    bilist_unschedule(bilist);
+    if (!BILIST_COMPACT(bilist)) {
+        slist_free(bilist->primary_slist);
+        slist_free(bilist->secondary_slist);
+    }
+    sarray_free(&(bilist->primary_array));
+    sarray_free(&(bilist->secondary_array));
+    table_free(&(bilist->table));
+    bloom_free(&(bilist->filter));
+    heap_free(&(bilist->expires));
+    if (bilist->name)
+        RedisModule_FreeString(NULL, bilist->name);
+
+    // Binodes and skip list nodes all live in the pool
+    pool_release(&(bilist->pool));
+    FREE(bilist);
 }
 
 void bilist_remove_node(struct bilist *bilist, struct binode *node)
 {
-    if (bilist->next_prune == node) {
-        bilist->next_prune = node->next;
-        if (bilist->next_prune == NULL) {
-            bilist->next_prune = bilist->first;
-        }
-    }
+    heap_remove(&(bilist->expires), &(node->expire));
     if (node->prev) {
         node->prev->next = node->next;
     }
@@ -140,448 +425,2160 @@ void bilist_remove_node(struct bilist *bilist, struct binode *node)
     }
     if (bilist->first == node)
         bilist->first = node->next;
+    if (bilist->defrag_next == node)
+        bilist->defrag_next = node->next;
 
-    bilist_data_free(node);
+    bilist_data_free(bilist, node);
 }
 
-struct binode * bilist_create_node(struct bilist *bilist, RedisModuleString *key1, RedisModuleString *key2, RedisModuleString *value, long expire)
+void bilist_primary_key(struct s_key *key, struct binode *binode)
 {
-    struct binode *binode;
-
-    binode = MALLOC(sizeof(struct binode));
-    binode->key1 = key1;
-    binode->key2 = key2;
-    binode->value = value;
-    binode->expire_time = expire;
-    binode->next = NULL;
-    binode->prev = NULL;
-
-    if (bilist->first) {
-        bilist->first->prev = binode;
-        binode->next = bilist->first;
-        bilist->first = binode;
-    } else {
-        bilist->first = binode;
-        bilist->next_prune = binode;
-    }
-    return binode;
+    slist_key(key, BINODE_KEY1(binode), binode->key1_len, BINODE_KEY2(binode), binode->key2_len);
 }
 
-int bilist_node_expired(struct binode *binode)
+void bilist_secondary_key(struct s_key *key, struct binode *binode)
 {
-    if (binode->expire_time == 0)
-        return 0;
-    
-    return binode->expire_time < RedisModule_Milliseconds();
+    slist_key(key, BINODE_KEY2(binode), binode->key2_len, BINODE_KEY1(binode), binode->key1_len);
 }
 
-int bilist_test_prune(struct bilist *bilist, long count)
+void bilist_string_key(struct s_key *key, RedisModuleString *key1, RedisModuleString *key2)
 {
-    struct binode *binode;
-    struct binode *tmpnode;
-
-    size_t size;
-    int pruned;
+    const char *key1_ptr, *key2_ptr;
+    size_t key1_len, key2_len;
 
-    binode = bilist->next_prune;
+    key1_ptr = RedisModule_StringPtrLen(key1, &key1_len);
+    key2_ptr = NULL;
+    key2_len = 0;
+    if (key2)
+        key2_ptr = RedisModule_StringPtrLen(key2, &key2_len);
 
-    pruned = 0;
-    while (count) {
-        if (binode == NULL) {
-            bilist->next_prune = bilist->first;
-            return pruned;
-        }
-        tmpnode = binode->next;
-        if (bilist_node_expired(binode)) {
-            slist_delete(bilist->primary_slist, RedisModule_StringPtrLen(binode->key1, &size), RedisModule_StringPtrLen(binode->key2, & size));
-            slist_delete(bilist->secondary_slist, RedisModule_StringPtrLen(binode->key2, &size), RedisModule_StringPtrLen(binode->key1, &size));
-            bilist_remove_node(bilist, binode);
-            bilist->items--;            
-            pruned++;
-        }
-        binode = tmpnode;
-        count--;
-    }
-    bilist->next_prune = binode;
-    return pruned;
+    slist_key(key, key1_ptr, key1_len, key2_ptr, key2_len);
 }
 
-void bilist_timer_handler(RedisModuleCtx *ctx, void *data)
+/*
+ * One pair of a batched command. The batch is sorted by key, so each
+ * lookup can continue from the search path of the one before it.
+ */
+struct bilist_op
 {
+    struct s_key key;
+    struct binode *binode;
+    struct binode *old;         // Replaced binode, mset only
+    long index;                 // Position in the command
+};
 
-    struct bilist *bilist = data;
-    int pruned;
+int bilist_op_cmp(const void *op1, const void *op2)
+{
+    const struct bilist_op *a = op1;
+    const struct bilist_op *b = op2;
+    int cmp;
+
+    cmp = keycmp(&(a->key), &(b->key));
+    if (cmp)
+        return cmp;
+    return a->index < b->index ? -1 : (a->index > b->index);
+}
 
-    do {
-        pruned = bilist_test_prune(bilist, BILIST_PRUNE_SIZE);
-    } while (pruned > BILIST_PRUNE_TRESHOLD);
+/*
+ * Builds the secondary index of a bilist whose binodes are all in the
+ * primary index only: sorts them by secondary key and appends them, which
+ * beats a search per binode.
+ */
+void bilist_build_secondary(struct bilist *bilist)
+{
+    struct bilist_op *ops;
+    struct binode *binode;
+    struct s_path path;
+    unsigned long i, n;
 
-    bilist->timer_id = RedisModule_CreateTimer(ctx, BILIST_TIMER_PERIOD, bilist_timer_handler, bilist);  // Refresh timer
-}
+    if (bilist->items == 0)
+        return;
 
-/* ========================= "bilist" type commands ======================= */
+    ops = RedisModule_Alloc(bilist->items * sizeof(struct bilist_op));
+    for (binode = bilist->first, n = 0; binode; binode = binode->next, n++) {
+        bilist_secondary_key(&(ops[n].key), binode);
+        ops[n].binode = binode;
+        ops[n].index = n;
+    }
+    qsort(ops, n, sizeof(struct bilist_op), bilist_op_cmp);
 
-static char key_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_-";
+    if (BILIST_COMPACT(bilist)) {
+        for (i = 0; i < n; i++)
+            sarray_insert_at(&(bilist->secondary_array), i, &(ops[i].key), ops[i].binode);
+    } else {
+        slist_path_tail(bilist->secondary_slist, &path);
+        for (i = 0; i < n; i++)
+            slist_append(bilist->secondary_slist, &path, &(ops[i].key), ops[i].binode);
+    }
+    RedisModule_Free(ops);
+}
 
-#define KEY_CHARS_ELEMENTS (sizeof(key_chars)/sizeof(key_chars[0])-1)
+/*
+ * Builds a deferred secondary index, on first use. That allocates a whole
+ * index, so the read commands that get here (get2, count2, rank2, walk)
+ * are flagged deny-oom like the writes.
+ */
+void bilist_ensure_secondary(struct bilist *bilist)
+{
+    if (!bilist->secondary_pending)
+        return;
+    bilist->secondary_pending = 0;
+    bilist_build_secondary(bilist);
+}
 
-int bilist_ckey_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+/*
+ * Adds a binode that is in neither index yet to both
+ */
+void bilist_index_node(struct bilist *bilist, struct binode *binode)
 {
-    long long count;
-    long long i;
+    struct s_array *array;
+    struct s_key key;
+
+    if (BILIST_COMPACT(bilist)) {
+        array = &(bilist->primary_array);
+        bilist_primary_key(&key, binode);
+        sarray_insert_at(array, sarray_count_less(array, &key), &key, binode);
+        array = &(bilist->secondary_array);
+        bilist_secondary_key(&key, binode);
+        sarray_insert_at(array, sarray_count_less(array, &key), &key, binode);
+    } else {
+        bilist_primary_key(&key, binode);
+        slist_insert(bilist->primary_slist, &key, binode);
+        bilist_secondary_key(&key, binode);
+        slist_insert(bilist->secondary_slist, &key, binode);
+    }
+    bilist_hash_node(bilist, binode);
+}
 
-    char *buffer;
+/*
+ * Binode of the pair key in the primary index, NULL if there is none
+ */
+struct binode * bilist_lookup(struct bilist *bilist, const struct s_key *key)
+{
+    struct s_entry *entry;
+    struct s_node *node;
+    u_int64_t hash = 0;
 
-    char suffix[10];
+    if (BILIST_COMPACT(bilist)) {
+        entry = sarray_find(&(bilist->primary_array), key);
+        return entry ? entry->data : NULL;
+    }
+    if (BILIST_HASHED(bilist) || BILIST_FILTERED(bilist))
+        hash = bilist_hash(key);
+    if (BILIST_FILTERED(bilist) && !bilist_filter_check(bilist, hash))
+        return NULL;
+    if (BILIST_HASHED(bilist))
+        return table_find(&(bilist->table), hash, bilist_node_match, key);
+    node = slist_find(bilist->primary_slist, key);
+    return node ? node->data : NULL;
+}
 
+struct bilist *bilist_get_from_key(RedisModuleCtx *ctx, RedisModuleString *keyname)
+{
     struct bilist *bilist;
+    RedisModuleKey *key;
+    int type;
 
-    RedisModule_AutoMemory(ctx);
+    key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
 
-    if (argc != 3)
-        return RedisModule_WrongArity(ctx);
+    type = RedisModule_KeyType(key);
 
-    bilist = bilist_get_from_key(ctx, argv[1]);
-    if (bilist == NULL) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != bilist_type) {
+        return NULL;
     }
 
-    if (RedisModule_StringToLongLong(argv[2],&count) != REDISMODULE_OK || count < 0) {
-        return RedisModule_ReplyWithError(ctx,"ERR invalid count parameter");
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        bilist = bilist_create();
+        RedisModule_ModuleTypeSetValue(key, bilist_type, bilist);
+    } else {
+        bilist = RedisModule_ModuleTypeGetValue(key);
+        // Writes keep both indexes up to date
+        bilist_ensure_secondary(bilist);
     }
+    RedisModule_CloseKey(key);
 
-    buffer = RedisModule_PoolAlloc(ctx, count+8+1);
+    bilist_set_name(bilist, keyname, RedisModule_GetSelectedDb(ctx));
 
-    char *ptr = buffer;
+    return bilist;
+}
 
-    for (i=0; i < count; i++) {
-        *ptr++ = key_chars[prand(&(bilist->prand)) % KEY_CHARS_ELEMENTS]; 
-    }
-    *ptr = '\0';
+/*
+ * Lookup for read only commands, never creates the key nor names the
+ * bilist. Returns REDISMODULE_ERR if the key holds another type, *bilist
+ * is set to NULL if the key does not exist.
+ */
+int bilist_read_from_key(RedisModuleCtx *ctx, RedisModuleString *keyname, struct bilist **bilist)
+{
+    RedisModuleKey *key;
+    int type;
 
-    sprintf(suffix,"%08x", bilist->counter);
-    strcat(ptr, suffix);
+    key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
 
-    bilist->counter += prand(&(bilist->prand)) % bilist->increment +1;
+    type = RedisModule_KeyType(key);
 
-    return RedisModule_ReplyWithSimpleString(ctx, buffer);
+    *bilist = NULL;
+    if (type != REDISMODULE_KEYTYPE_EMPTY) {
+        if (RedisModule_ModuleTypeGetType(key) != bilist_type) {
+            RedisModule_CloseKey(key);
+            return REDISMODULE_ERR;
+        }
+        *bilist = RedisModule_ModuleTypeGetValue(key);
+    }
+    RedisModule_CloseKey(key);
+
+    return REDISMODULE_OK;
 }
 
-int bilist_set_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+/*
+ * Lookup for the commands that delete pairs, never creates the key.
+ * Returns like bilist_read_from_key, an existing bilist is made ready for
+ * writes like in bilist_get_from_key.
+ */
+int bilist_write_from_key(RedisModuleCtx *ctx, RedisModuleString *keyname, struct bilist **bilist)
 {
-    struct bilist *bilist;
-    size_t size;
-    RedisModuleString *data;
-    RedisModuleString *stringkey1;
-    RedisModuleString * stringkey2;
-
-    struct binode *binode;
-    struct binode *oldnode;
+    if (bilist_read_from_key(ctx, keyname, bilist) != REDISMODULE_OK)
+        return REDISMODULE_ERR;
 
-    long long expire;
+    if (*bilist) {
+        bilist_ensure_secondary(*bilist);
+        bilist_set_name(*bilist, keyname, RedisModule_GetSelectedDb(ctx));
+    }
+    return REDISMODULE_OK;
+}
 
-    RedisModule_AutoMemory(ctx);
+/*
+ * Deletes the key of a bilist left without pairs, which frees the bilist.
+ * Replicas do the same when the deletes that emptied it reach them.
+ */
+void bilist_delete_if_empty(RedisModuleCtx *ctx, RedisModuleString *keyname, struct bilist *bilist)
+{
+    RedisModuleKey *key;
 
-    if (argc != 6)
-        return RedisModule_WrongArity(ctx);
+    if (bilist->items)
+        return;
+    key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_WRITE);
+    RedisModule_DeleteKey(key);
+    RedisModule_CloseKey(key);
+}
 
-    bilist = bilist_get_from_key(ctx, argv[1]);
+/*
+ * Walks one index of a bilist in either encoding. rank is the position
+ * in the index counting from 1, 0 and size + 1 are past either end.
+ * A walk that leaves the index does not come back.
+ */
+struct bilist_iter
+{
+    struct s_list *list;
+    struct s_array *array;
+    struct s_node *node;        // Skip list encoding only
+    unsigned long rank;
+};
 
-    if (bilist == NULL) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+void bilist_iter_init(struct bilist_iter *it, struct bilist *bilist, int secondary)
+{
+    if (secondary)
+        bilist_ensure_secondary(bilist);
+    if (BILIST_COMPACT(bilist)) {
+        it->list = NULL;
+        it->array = secondary ? &(bilist->secondary_array) : &(bilist->primary_array);
+    } else {
+        it->list = secondary ? bilist->secondary_slist : bilist->primary_slist;
+        it->array = NULL;
     }
+    it->node = NULL;
+    it->rank = 0;
+}
 
-    if (RedisModule_StringToLongLong(argv[5], & expire) != REDISMODULE_OK) {
-        return RedisModule_ReplyWithError(ctx, "ERR Invalid expire time");
-    }
-    
-    stringkey1 = RedisModule_CreateStringFromString(NULL, argv[2]);
-    stringkey2 = RedisModule_CreateStringFromString(NULL, argv[3]);
-    data = RedisModule_CreateStringFromString(NULL, argv[4]);
+/*
+ * Moves to the first pair not less than key
+ */
+void bilist_iter_lower_bound(struct bilist_iter *it, const struct s_key *key)
+{
+    struct s_path path;
 
-    if (expire) {
-        expire *= 1000;
-        expire += RedisModule_Milliseconds();
+    if (it->list) {
+        slist_path(it->list, key, &path);
+        it->node = path.node[0]->level[0].next;
+        it->rank = path.rank[0] + 1;
+    } else {
+        it->rank = sarray_count_less(it->array, key) + 1;
     }
+}
+
+/*
+ * Moves to the last pair not greater than key
+ */
+void bilist_iter_floor(struct bilist_iter *it, const struct s_key *key)
+{
+    struct s_path path;
 
-    if (!bilist->timer_active) {
-        bilist->timer_id = RedisModule_CreateTimer(ctx, BILIST_TIMER_PERIOD, bilist_timer_handler, bilist);
-        bilist->timer_active = 1;
+    if (it->list) {
+        it->node = slist_path_floor(it->list, key, &path);
+        it->rank = path.rank[0];
+    } else {
+        it->rank = sarray_count_not_greater(it->array, key);
     }
+}
 
-    binode = bilist_create_node(bilist, stringkey1, stringkey2, data, expire);
+void bilist_iter_seek(struct bilist_iter *it, unsigned long rank)
+{
+    if (it->list)
+        it->node = slist_at(it->list, rank);
+    it->rank = rank;
+}
 
-    oldnode = slist_insert(bilist->primary_slist, RedisModule_StringPtrLen(stringkey1, &size), RedisModule_StringPtrLen(stringkey2, &size), binode);
-    
-    slist_insert(bilist->secondary_slist, RedisModule_StringPtrLen(stringkey2, &size), RedisModule_StringPtrLen(stringkey1, &size), binode);
+void bilist_iter_next(struct bilist_iter *it)
+{
+    if (it->node)
+        it->node = it->node->level[0].next;
+    it->rank++;
+}
 
-    if (oldnode) {
-        bilist_remove_node(bilist, oldnode);
-    } else {
-        bilist->items++;
-    }
+void bilist_iter_prev(struct bilist_iter *it)
+{
+    if (it->node)
+        it->node = it->node->prev_n;
+    it->rank--;
+}
 
-    RedisModuleString *guardian = RedisModule_CreateStringPrintf(ctx, "::bilist-guardian::", argv[1]);
+/*
+ * Key and binode at the current position, NULL past either end
+ */
+const struct s_key * bilist_iter_key(const struct bilist_iter *it)
+{
+    if (it->list)
+        return it->node ? &(it->node->key) : NULL;
+    if (it->rank == 0 || it->rank > it->array->size)
+        return NULL;
+    return &(it->array->entries[it->rank - 1].key);
+}
 
-    RedisModule_Call(ctx, "INCR", "s", guardian);
-    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+struct binode * bilist_iter_binode(const struct bilist_iter *it)
+{
+    if (it->list)
+        return it->node ? it->node->data : NULL;
+    if (it->rank == 0 || it->rank > it->array->size)
+        return NULL;
+    return it->array->entries[it->rank - 1].data;
 }
 
-int bilist_get_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+/*
+ * Unlinks binode from both indexes and frees it
+ */
+void bilist_delete_node(struct bilist *bilist, struct binode *binode)
 {
-    struct bilist *bilist;
-    size_t size;
+    struct s_key key;
 
-    struct s_node *node;
+    if (BILIST_COMPACT(bilist)) {
+        bilist_primary_key(&key, binode);
+        sarray_delete(&(bilist->primary_array), &key);
+        bilist_secondary_key(&key, binode);
+        sarray_delete(&(bilist->secondary_array), &key);
+    } else {
+        bilist_primary_key(&key, binode);
+        slist_delete(bilist->primary_slist, &key);
+        bilist_secondary_key(&key, binode);
+        slist_delete(bilist->secondary_slist, &key);
+    }
+    if (!BILIST_COMPACT(bilist))
+        bilist_unhash_node(bilist, binode);
+    bilist_remove_node(bilist, binode);
+    bilist->items--;
+    bilist->version++;
+}
 
+struct binode * bilist_alloc_node(struct bilist *bilist, const char *key1, size_t key1_len, const char *key2, size_t key2_len, const char *value, size_t value_len, long long expire)
+{
     struct binode *binode;
 
-    RedisModule_AutoMemory(ctx);
+    binode = pool_alloc(&(bilist->pool), sizeof(struct binode) + key1_len + key2_len + value_len);
+    binode->key1_len = key1_len;
+    binode->key2_len = key2_len;
+    binode->value_len = value_len;
 
-    if (argc != 4)
-        return RedisModule_WrongArity(ctx);
+    memcpy(BINODE_KEY1(binode), key1, key1_len);
+    memcpy(BINODE_KEY2(binode), key2, key2_len);
+    memcpy(BINODE_VALUE(binode), value, value_len);
+
+    binode->expire.when = expire;
+    binode->expire.index = 0;
+    binode->next = NULL;
+    binode->prev = NULL;
+    return binode;
+}
+
+struct binode * bilist_create_node(struct bilist *bilist, RedisModuleString *key1, RedisModuleString *key2, RedisModuleString *value, long long expire)
+{
+    struct binode *binode;
+    const char *key1_ptr, *key2_ptr, *value_ptr;
+    size_t key1_len, key2_len, value_len;
+
+    key1_ptr = RedisModule_StringPtrLen(key1, &key1_len);
+    key2_ptr = RedisModule_StringPtrLen(key2, &key2_len);
+    value_ptr = RedisModule_StringPtrLen(value, &value_len);
+
+    binode = bilist_alloc_node(bilist, key1_ptr, key1_len, key2_ptr, key2_len, value_ptr, value_len, expire);
+
+    if (bilist->first) {
+        bilist->first->prev = binode;
+        binode->next = bilist->first;
+    }
+    bilist->first = binode;
+    bilist->version++;
+
+    if (expire)
+        heap_push(&(bilist->expires), &(binode->expire));
+    return binode;
+}
+
+/*
+ * Converts a ttl in seconds into an absolute expire time in ms, 0 stays 0.
+ * With absolute set, ttl already is a Unix time in ms. Negative times and
+ * ttls whose absolute time would overflow are rejected, so replicas accept
+ * every PXAT time the master sends them.
+ */
+int bilist_parse_expire(RedisModuleString *ttl, int absolute, long long *expire)
+{
+    long long now;
+
+    if (RedisModule_StringToLongLong(ttl, expire) != REDISMODULE_OK || *expire < 0)
+        return REDISMODULE_ERR;
+
+    if (absolute || *expire == 0)
+        return REDISMODULE_OK;
+    now = RedisModule_Milliseconds();
+    if (*expire > (LLONG_MAX - now) / 1000)
+        return REDISMODULE_ERR;
+    *expire = *expire * 1000 + now;
+    return REDISMODULE_OK;
+}
+
+/*
+ * Links the sorted ops into list with finger searches. An existing node
+ * keeps its place and gets the new binode, the old one is left in op->old.
+ */
+void bilist_index_ops(struct s_list *list, struct bilist_op *ops, long count)
+{
+    struct s_path path;
+    struct s_node *node;
+    long i;
+
+    for (i = 0; i < count; i++) {
+        if (i == 0)
+            node = slist_path(list, &(ops[i].key), &path);
+        else
+            node = slist_path_next(list, &(ops[i].key), &path);
+
+        if (node) {
+            ops[i].old = node->data;
+            node->key = ops[i].key;
+            node->data = ops[i].binode;
+        } else {
+            slist_link(list, &path, &(ops[i].key), ops[i].binode);
+        }
+    }
+}
+
+/*
+ * bilist_index_ops for the compact encoding
+ */
+void bilist_index_ops_compact(struct s_array *array, struct bilist_op *ops, long count)
+{
+    u_int32_t index;
+    long i;
+
+    for (i = 0; i < count; i++) {
+        index = sarray_count_less(array, &(ops[i].key));
+
+        if (index < array->size && keycmp(&(array->entries[index].key), &(ops[i].key)) == 0) {
+            ops[i].old = array->entries[index].data;
+            array->entries[index].key = ops[i].key;
+            array->entries[index].data = ops[i].binode;
+        } else {
+            sarray_insert_at(array, index, &(ops[i].key), ops[i].binode);
+        }
+    }
+}
+
+/*
+ * Stores a new value and expire time in the binode of a pair, if its pool
+ * chunk can take them. The indexes do not change. Returns 0 if the binode
+ * has to be replaced instead.
+ */
+int bilist_update_node(struct bilist *bilist, struct binode *binode, RedisModuleString *value, long long expire)
+{
+    const char *value_ptr;
+    size_t value_len;
+
+    value_ptr = RedisModule_StringPtrLen(value, &value_len);
+    if (!pool_fits(BINODE_SIZE(binode), BINODE_SIZE(binode) - binode->value_len + value_len))
+        return 0;
+
+    memcpy(BINODE_VALUE(binode), value_ptr, value_len);
+    binode->value_len = value_len;
+
+    heap_remove(&(bilist->expires), &(binode->expire));
+    binode->expire.when = expire;
+    if (expire)
+        heap_push(&(bilist->expires), &(binode->expire));
+    bilist->version++;
+    return 1;
+}
+
+/*
+ * Sets count pairs given as key1 key2 value triples at argv, expires
+ * holding their absolute expire times. When a pair is repeated the last
+ * one wins, as if the pairs had been set one by one.
+ *
+ * With the hash table, existing pairs are updated in place as long as the
+ * new values fit, in argument order. Once one does not, it and the pairs
+ * after it go through the indexes, which keeps the last one winning.
+ */
+void bilist_set_pairs(RedisModuleCtx *ctx, struct bilist *bilist, RedisModuleString **argv, long count, long long *expires)
+{
+    struct bilist_op *ops;
+    struct binode *old;
+    struct s_key key;
+    long i, n;
+
+    ops = RedisModule_PoolAlloc(ctx, count * sizeof(struct bilist_op));
+
+    for (i = 0, n = 0; i < count; i++) {
+        if (expires[i])
+            bilist_schedule(bilist);
+        if (n == 0 && BILIST_HASHED(bilist)) {
+            bilist_string_key(&key, argv[i*3], argv[i*3+1]);
+            old = bilist_lookup(bilist, &key);
+            if (old && bilist_update_node(bilist, old, argv[i*3+2], expires[i]))
+                continue;
+        }
+        ops[n].binode = bilist_create_node(bilist, argv[i*3], argv[i*3+1], argv[i*3+2], expires[i]);
+        ops[n].old = NULL;
+        ops[n].index = n;
+        bilist_primary_key(&(ops[n].key), ops[n].binode);
+        n++;
+    }
+    count = n;
+
+    if (count > 1)
+        qsort(ops, count, sizeof(struct bilist_op), bilist_op_cmp);
+
+    // Earlier duplicates never reach the indexes
+    for (i = 0, n = 0; i < count; i++) {
+        if (i + 1 < count && keycmp(&(ops[i].key), &(ops[i+1].key)) == 0) {
+            bilist_remove_node(bilist, ops[i].binode);
+            continue;
+        }
+        ops[n++] = ops[i];
+    }
+
+    // Replaced pairs are counted too, so this can expand a little early
+    if (BILIST_COMPACT(bilist) && bilist->items + n > (unsigned long long)bilist_compact_entries)
+        bilist_expand(bilist);
+
+    if (BILIST_COMPACT(bilist))
+        bilist_index_ops_compact(&(bilist->primary_array), ops, n);
+    else
+        bilist_index_ops(bilist->primary_slist, ops, n);
+
+    for (i = 0; i < n; i++)
+        bilist_secondary_key(&(ops[i].key), ops[i].binode);
+    if (n > 1)
+        qsort(ops, n, sizeof(struct bilist_op), bilist_op_cmp);
+
+    if (BILIST_COMPACT(bilist))
+        bilist_index_ops_compact(&(bilist->secondary_array), ops, n);
+    else
+        bilist_index_ops(bilist->secondary_slist, ops, n);
+
+    for (i = 0; i < n; i++) {
+        if (ops[i].old) {
+            if (BILIST_HASHED(bilist))
+                table_replace(&(bilist->table), bilist_node_hash(ops[i].old), ops[i].old, ops[i].binode);
+            bilist_remove_node(bilist, ops[i].old);
+        } else {
+            bilist_hash_node(bilist, ops[i].binode);
+            bilist->items++;
+        }
+    }
+}
+
+/*
+ * Deletes the binodes of ops, already unlinked from the other index, from
+ * the primary or the secondary index. The ops are keyed for that index,
+ * sorting them lets every unlink reuse the search path of the one before.
+ */
+void bilist_delete_ops(struct bilist *bilist, int secondary, struct bilist_op *ops, long count)
+{
+    struct s_list *list;
+    struct s_path path;
+    struct s_node *node;
+    long i;
+
+    if (count > 1)
+        qsort(ops, count, sizeof(struct bilist_op), bilist_op_cmp);
+
+    list = secondary ? bilist->secondary_slist : bilist->primary_slist;
+
+    for (i = 0; i < count; i++) {
+        if (BILIST_COMPACT(bilist)) {
+            sarray_delete(secondary ? &(bilist->secondary_array) : &(bilist->primary_array), &(ops[i].key));
+        } else {
+            if (i == 0)
+                node = slist_path(list, &(ops[i].key), &path);
+            else
+                node = slist_path_next(list, &(ops[i].key), &path);
+
+            slist_unlink(list, &path, node);
+        }
+        if (!BILIST_COMPACT(bilist))
+            bilist_unhash_node(bilist, ops[i].binode);
+        bilist_remove_node(bilist, ops[i].binode);
+        bilist->items--;
+        bilist->version++;
+    }
+}
+
+int bilist_node_expired(struct binode *binode)
+{
+    if (binode->expire.when == 0)
+        return 0;
+    
+    return binode->expire.when < RedisModule_Milliseconds();
+}
+
+/*
+ * Deletes up to BILIST_PRUNE_SIZE expired binodes and replicates them as
+ * one bilist.mdel. Only the head of the expiry heap is looked at, so live
+ * entries are never scanned.
+ */
+int bilist_test_prune(RedisModuleCtx *ctx, struct bilist *bilist)
+{
+    struct h_node *expire;
+    struct binode *binode;
+    RedisModuleString *pairs[BILIST_PRUNE_SIZE * 2];
+
+    long long now;
+    int pruned;
+    int i;
+
+    now = RedisModule_Milliseconds();
+
+    expire = heap_top(&(bilist->expires));
+    if (expire && expire->when < now)
+        bilist_ensure_secondary(bilist);
+
+    pruned = 0;
+    while (pruned < BILIST_PRUNE_SIZE && (expire = heap_top(&(bilist->expires))) && expire->when < now) {
+        binode = BINODE_FROM_EXPIRE(expire);
+        pairs[pruned*2] = RedisModule_CreateString(ctx, BINODE_KEY1(binode), binode->key1_len);
+        pairs[pruned*2+1] = RedisModule_CreateString(ctx, BINODE_KEY2(binode), binode->key2_len);
+        bilist_delete_node(bilist, binode);
+        pruned++;
+    }
+
+    if (pruned) {
+        RedisModule_SelectDb(ctx, bilist->db);
+        RedisModule_Replicate(ctx, "bilist.mdel", "sv", bilist->name, pairs, (size_t)pruned * 2);
+        for (i = 0; i < pruned * 2; i++)
+            RedisModule_FreeString(ctx, pairs[i]);
+    }
+    return pruned;
+}
+
+/*
+ * Prunes the scheduled bilists in batches of BILIST_PRUNE_SIZE, staying on
+ * a bilist while it fills whole batches. Stops once the time budget is
+ * spent or a full round found nothing due.
+ *
+ * Replicas leave expired pairs to the deletes replicated by the master,
+ * reads hide them in the meantime.
+ */
+void bilist_timer_handler(RedisModuleCtx *ctx, void *data)
+{
+    struct bilist *bilist;
+
+    u_int64_t start;
+    unsigned long idle;
+    int pruned;
+    int replica;
+
+    REDISMODULE_NOT_USED(data);
+
+    start = RedisModule_MonotonicMicroseconds();
+    idle = 0;
+    replica = RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_SLAVE;
+
+    while (!replica && expire_lists && idle < expire_lists) {
+        if (expire_cursor == NULL)
+            expire_cursor = expire_first;
+        bilist = expire_cursor;
+
+        // Loaded without a key name, left until a write names it
+        if (bilist->name == NULL) {
+            expire_cursor = bilist->expire_next;
+            idle++;
+            continue;
+        }
+
+        pruned = bilist_test_prune(ctx, bilist);
+        if (bilist->items == 0) {
+            // Deleting the key takes the bilist off the scheduler and moves the cursor on
+            bilist_delete_if_empty(ctx, bilist->name, bilist);
+            idle = 0;
+        } else if (pruned < BILIST_PRUNE_SIZE) {
+            expire_cursor = bilist->expire_next;
+            if (heap_top(&(bilist->expires)) == NULL)
+                bilist_unschedule(bilist);
+            idle = pruned ? 0 : idle + 1;
+        } else {
+            idle = 0;
+        }
+
+        if (RedisModule_MonotonicMicroseconds() - start >= (u_int64_t)bilist_expire_budget)
+            break;
+    }
+
+    RedisModule_CreateTimer(ctx, BILIST_TIMER_PERIOD, bilist_timer_handler, NULL);  // Refresh timer
+}
+
+/* ========================= "bilist" type commands ======================= */
+
+static char key_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_-";
+
+#define KEY_CHARS_ELEMENTS (sizeof(key_chars)/sizeof(key_chars[0])-1)
+
+int bilist_ckey_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    long long count;
+    long long i;
+
+    char *buffer;
+
+    char suffix[10];
+
+    struct bilist *bilist;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 3)
+        return RedisModule_WrongArity(ctx);
+
+    bilist = bilist_get_from_key(ctx, argv[1]);
+    if (bilist == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (RedisModule_StringToLongLong(argv[2],&count) != REDISMODULE_OK || count < 0) {
+        return RedisModule_ReplyWithError(ctx,"ERR invalid count parameter");
+    }
+
+    buffer = RedisModule_PoolAlloc(ctx, count+8+1);
+
+    char *ptr = buffer;
+
+    for (i=0; i < count; i++) {
+        *ptr++ = key_chars[prand(&(bilist->prand)) % KEY_CHARS_ELEMENTS]; 
+    }
+    *ptr = '\0';
+
+    sprintf(suffix,"%08x", bilist->counter);
+    strcat(ptr, suffix);
+
+    bilist->counter += prand(&(bilist->prand)) % bilist->increment +1;
+
+    // Replicas get the generator state instead of drawing their own keys
+    RedisModule_Replicate(ctx, "bilist.seed", "slll", argv[1], (long long)bilist->counter,
+                          (long long)bilist->increment, (long long)bilist->prand.state.a);
+
+    return RedisModule_ReplyWithSimpleString(ctx, buffer);
+}
+
+/*
+ * bilist.seed list-name counter increment state [version]
+ * Sets the generator of bilist.ckey, how bilist.ckey is replicated. The
+ * version is only given by AOF rewrites, after the pairs.
+ */
+int bilist_seed_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    struct bilist *bilist;
+
+    long long counter;
+    long long increment;
+    long long state;
+    long long version = 0;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 5 && argc != 6)
+        return RedisModule_WrongArity(ctx);
+
+    if (RedisModule_StringToLongLong(argv[2], &counter) != REDISMODULE_OK || counter < 0 || counter > 0xffffffffLL ||
+        RedisModule_StringToLongLong(argv[3], &increment) != REDISMODULE_OK || increment < 1 || increment > 0xff ||
+        RedisModule_StringToLongLong(argv[4], &state) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid generator state");
+    }
+    if (argc == 6 && (RedisModule_StringToLongLong(argv[5], &version) != REDISMODULE_OK || version < 0)) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid version");
+    }
+
+    bilist = bilist_get_from_key(ctx, argv[1]);
+    if (bilist == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    bilist->counter = counter;
+    bilist->increment = increment;
+    bilist->prand.state.a = (u_int64_t)state;
+    if (argc == 6)
+        bilist->version = (u_int64_t)version;
+
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+int bilist_set_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    struct bilist *bilist;
+
+    long long expire;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 6)
+        return RedisModule_WrongArity(ctx);
+
+    // Checked before the key is created, a failed set leaves no empty key
+    if (bilist_parse_expire(argv[5], 0, &expire) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, "ERR Invalid expire time");
+    }
 
     bilist = bilist_get_from_key(ctx, argv[1]);
 
     if (bilist == NULL) {
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
- 
-    node = slist_find(bilist->primary_slist, RedisModule_StringPtrLen(argv[2], &size), RedisModule_StringPtrLen(argv[3], &size));
 
-    if (node == NULL) {
+    bilist_set_pairs(ctx, bilist, argv + 2, 1, &expire);
+
+    // Sent with the absolute expire time, replicas may apply it later
+    RedisModule_Replicate(ctx, "bilist.mset", "scsssl", argv[1], "PXAT", argv[2], argv[3], argv[4], expire);
+
+    RedisModule_SignalModifiedKey(ctx, argv[1]);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/*
+ * bilist.mset list-name [PXAT] key1 key2 value expire-time [key1 key2 value expire-time ...]
+ * PXAT takes the expire times as Unix times in ms, as in AOF rewrites.
+ * It is told apart from a key1 by the number of arguments.
+ */
+int bilist_mset_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    struct bilist *bilist;
+
+    RedisModuleString **pairs;
+    RedisModuleString **repl;
+    long long *expires;
+    long count;
+    long i;
+    int absolute;
+    int first;
+
+    RedisModule_AutoMemory(ctx);
+
+    absolute = (argc - 2) % 4 == 1 && strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "PXAT") == 0;
+    first = absolute ? 3 : 2;
+
+    if (argc < first + 4 || (argc - first) % 4 != 0)
+        return RedisModule_WrongArity(ctx);
+
+    count = (argc - first) / 4;
+
+    // Check every expire time before anything is changed
+    expires = RedisModule_PoolAlloc(ctx, count * sizeof(long long));
+    pairs = RedisModule_PoolAlloc(ctx, count * 3 * sizeof(RedisModuleString *));
+    for (i = 0; i < count; i++) {
+        if (bilist_parse_expire(argv[first + i*4 + 3], absolute, &expires[i]) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(ctx, "ERR Invalid expire time");
+        }
+        pairs[i*3] = argv[first + i*4];
+        pairs[i*3+1] = argv[first + i*4 + 1];
+        pairs[i*3+2] = argv[first + i*4 + 2];
+    }
+
+    bilist = bilist_get_from_key(ctx, argv[1]);
+
+    if (bilist == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    bilist_set_pairs(ctx, bilist, pairs, count, expires);
+
+    if (absolute) {
+        RedisModule_ReplicateVerbatim(ctx);
+    } else {
+        repl = RedisModule_PoolAlloc(ctx, count * 4 * sizeof(RedisModuleString *));
+        for (i = 0; i < count; i++) {
+            repl[i*4] = pairs[i*3];
+            repl[i*4+1] = pairs[i*3+1];
+            repl[i*4+2] = pairs[i*3+2];
+            repl[i*4+3] = RedisModule_CreateStringFromLongLong(ctx, expires[i]);
+        }
+        RedisModule_Replicate(ctx, "bilist.mset", "scv", argv[1], "PXAT", repl, (size_t)count * 4);
+    }
+
+    RedisModule_SignalModifiedKey(ctx, argv[1]);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+int bilist_get_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    struct bilist *bilist;
+    struct s_key key;
+
+    struct binode *binode;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 4)
+        return RedisModule_WrongArity(ctx);
+
+    if (bilist_read_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (bilist == NULL) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+ 
+    bilist_string_key(&key, argv[2], argv[3]);
+    binode = bilist_lookup(bilist, &key);
+
+    if (binode == NULL) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    if (bilist_node_expired(binode)) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    return RedisModule_ReplyWithStringBuffer(ctx, BINODE_VALUE(binode), binode->value_len);
+}
+
+/*
+ * Shared by get1 and get2: replies with the partners of argv[2] in list,
+ * which is the primary index for get1 and the secondary one for get2.
+ *   FROM partner, TO partner - inclusive bounds on the partner key
+ *   LIMIT offset count       - skip offset pairs, return at most count
+ *   REV                      - from the highest partner down
+ */
+int bilist_get_partners(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int secondary)
+{
+    struct bilist *bilist;
+    struct bilist_iter it;
+    struct s_key lo, hi;
+    const struct s_key *key;
+
+    struct binode *binode;
+
+    RedisModuleString *from, *to;
+    const char *option;
+    long long offset, limit;
+    long elements;
+    int reverse;
+    int i;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 3)
+        return RedisModule_WrongArity(ctx);
+
+    from = NULL;
+    to = NULL;
+    offset = 0;
+    limit = -1;
+    reverse = 0;
+
+    for (i = 3; i < argc; i++) {
+        option = RedisModule_StringPtrLen(argv[i], NULL);
+        if (strcasecmp(option, "FROM") == 0 && i + 1 < argc) {
+            from = argv[++i];
+        } else if (strcasecmp(option, "TO") == 0 && i + 1 < argc) {
+            to = argv[++i];
+        } else if (strcasecmp(option, "LIMIT") == 0 && i + 2 < argc) {
+            if (RedisModule_StringToLongLong(argv[i+1], &offset) != REDISMODULE_OK || offset < 0 ||
+                RedisModule_StringToLongLong(argv[i+2], &limit) != REDISMODULE_OK) {
+                return RedisModule_ReplyWithError(ctx, "ERR invalid LIMIT parameter");
+            }
+            i += 2;
+        } else if (strcasecmp(option, "REV") == 0) {
+            reverse = 1;
+        } else {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+    }
+
+    if (bilist_read_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (bilist == NULL || limit == 0) {
+        return RedisModule_ReplyWithArray(ctx, 0);
+    }
+
+    // A NULL partner matches every partner, so the bounds default to the whole key
+    bilist_string_key(&lo, argv[2], from);
+    bilist_string_key(&hi, argv[2], to);
+
+    if (!bilist_filter_partners(bilist, &lo, secondary)) {
+        return RedisModule_ReplyWithArray(ctx, 0);
+    }
+
+    bilist_iter_init(&it, bilist, secondary);
+
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+
+    elements = 0;
+
+    // The offset is skipped by rank, expired pairs not yet reclaimed included
+    if (reverse) {
+        bilist_iter_floor(&it, &hi);
+        if (offset)
+            bilist_iter_seek(&it, it.rank > (unsigned long long)offset ? it.rank - offset : 0);
+    } else {
+        bilist_iter_lower_bound(&it, &lo);
+        if (offset)
+            bilist_iter_seek(&it, it.rank + offset);
+    }
+
+    while ((key = bilist_iter_key(&it)) && keycmp(key, &lo) >= 0 && keycmp(key, &hi) <= 0) {
+        binode = bilist_iter_binode(&it);
+        if (reverse)
+            bilist_iter_prev(&it);
+        else
+            bilist_iter_next(&it);
+
+        if (bilist_node_expired(binode))
+            continue;
+
+        RedisModule_ReplyWithArray(ctx, 2);
+        if (secondary)
+            RedisModule_ReplyWithStringBuffer(ctx, BINODE_KEY1(binode), binode->key1_len);
+        else
+            RedisModule_ReplyWithStringBuffer(ctx, BINODE_KEY2(binode), binode->key2_len);
+        RedisModule_ReplyWithStringBuffer(ctx, BINODE_VALUE(binode), binode->value_len);
+        elements++;
+
+        if (elements == limit)
+            break;
+    }
+    RedisModule_ReplySetArrayLength(ctx, elements);
+    return REDISMODULE_OK;
+}
+
+int bilist_get1_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    return bilist_get_partners(ctx, argv, argc, 0);
+}
+
+int bilist_get2_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    return bilist_get_partners(ctx, argv, argc, 1);
+}
+
+/*
+ * Shared by count1 and count2: the number of partners of argv[2], counted
+ * from the span of the key's range in O(log n). Expired pairs that were
+ * not reclaimed yet are included, as in bilist.count.
+ */
+int bilist_count_partners(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int secondary)
+{
+    struct bilist *bilist;
+    struct bilist_iter it;
+    struct s_key key;
+    unsigned long last;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 3)
+        return RedisModule_WrongArity(ctx);
+
+    if (bilist_read_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (bilist == NULL) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    bilist_string_key(&key, argv[2], NULL);
+    if (!bilist_filter_partners(bilist, &key, secondary)) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    bilist_iter_init(&it, bilist, secondary);
+    bilist_iter_floor(&it, &key);
+    last = it.rank;
+    bilist_iter_lower_bound(&it, &key);
+    return RedisModule_ReplyWithLongLong(ctx, last + 1 - it.rank);
+}
+
+int bilist_count1_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    return bilist_count_partners(ctx, argv, argc, 0);
+}
+
+int bilist_count2_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    return bilist_count_partners(ctx, argv, argc, 1);
+}
+
+/*
+ * Shared by rank1 and rank2: the position of partner argv[3] among the
+ * partners of argv[2], from 0, or nil if the pair does not exist. This is
+ * the LIMIT offset at which the pair starts a page.
+ */
+int bilist_rank_partner(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int secondary)
+{
+    struct bilist *bilist;
+    struct bilist_iter it;
+    struct s_key key;
+    struct binode *binode;
+    unsigned long rank;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 4)
+        return RedisModule_WrongArity(ctx);
+
+    if (bilist_read_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (bilist == NULL) {
         return RedisModule_ReplyWithNull(ctx);
     }
 
-    binode = node->data;
+    bilist_string_key(&key, argv[2], argv[3]);
+    if (!bilist_filter_partners(bilist, &key, secondary)) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
 
-    if (bilist_node_expired(binode)) {
-        slist_delete(bilist->primary_slist, RedisModule_StringPtrLen(argv[2], &size), RedisModule_StringPtrLen(argv[3], & size));
-        slist_delete(bilist->secondary_slist, RedisModule_StringPtrLen(argv[3], &size), RedisModule_StringPtrLen(argv[2], &size));
+    bilist_iter_init(&it, bilist, secondary);
+    bilist_iter_lower_bound(&it, &key);
+    binode = bilist_iter_binode(&it);
+    if (binode == NULL || keycmp(bilist_iter_key(&it), &key) != 0 || bilist_node_expired(binode)) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+    rank = it.rank;
 
-        bilist_remove_node(bilist, binode);
+    key.secondary_key = NULL;
+    bilist_iter_lower_bound(&it, &key);
+    return RedisModule_ReplyWithLongLong(ctx, rank - it.rank);
+}
 
-        bilist->items--;
-        return RedisModule_ReplyWithNull(ctx);
+int bilist_rank1_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    return bilist_rank_partner(ctx, argv, argc, 0);
+}
+
+int bilist_rank2_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    return bilist_rank_partner(ctx, argv, argc, 1);
+}
+
+/*
+ * A key reached by bilist.walk, with the number of walks from the start
+ * key that end on it, capped at LLONG_MAX. The key points into a binode:
+ * walk only reads, so the binodes stay in place until it replies.
+ */
+struct bilist_walk_node
+{
+    const char *key;
+    u_int32_t len;
+    long long count;
+    unsigned long index;                // Order of discovery in its hop
+    struct bilist_walk_node *next;      // Next key of the same hop
+};
+
+int bilist_walk_match(const void *data, const void *key)
+{
+    const struct bilist_walk_node *a = data;
+    const struct bilist_walk_node *b = key;
+
+    return a->len == b->len && memcmp(a->key, b->key, a->len) == 0;
+}
+
+/*
+ * Most walks first, then in order of discovery
+ */
+int bilist_walk_cmp(const void *node1, const void *node2)
+{
+    const struct bilist_walk_node *a = *(struct bilist_walk_node * const *)node1;
+    const struct bilist_walk_node *b = *(struct bilist_walk_node * const *)node2;
+
+    if (a->count != b->count)
+        return a->count > b->count ? -1 : 1;
+    return a->index < b->index ? -1 : a->index > b->index;
+}
+
+/*
+ * Breadth first walk of the pairs as a bipartite graph. Each hop reads the
+ * partners of every key of the hop before, and merges the keys it reaches
+ * in a scratch hash table, adding up their walk counts. Only the keys of
+ * the last hop are returned: in order of discovery, or with WITHCOUNTS
+ * ranked by count. Without WITHCOUNTS the walk stops at LIMIT keys.
+ *
+ * DEPTH is at most BILIST_WALK_DEPTH, and a walk that would read more than
+ * BILIST_WALK_PAIRS pairs fails instead of blocking the server.
+ */
+int bilist_walk_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    struct bilist *bilist;
+    struct bilist_iter it;
+    struct s_key key;
+    const struct s_key *partner;
+    struct t_table seen;
+
+    struct bilist_walk_node start, probe;
+    struct bilist_walk_node *frontier, *first, *last, *node, *found;
+    struct bilist_walk_node **nodes;
+
+    const char *option;
+    long long direction, depth, limit;
+    int exclude_start, withcounts, secondary, done;
+    unsigned long found_count, elements, pairs, n;
+    u_int64_t hash;
+    size_t len;
+    long long hop;
+    int i;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 3)
+        return RedisModule_WrongArity(ctx);
+
+    direction = 1;
+    depth = 2;
+    limit = -1;
+    exclude_start = 0;
+    withcounts = 0;
+
+    for (i = 3; i < argc; i++) {
+        option = RedisModule_StringPtrLen(argv[i], NULL);
+        if (strcasecmp(option, "DIRECTION") == 0 && i + 1 < argc) {
+            if (RedisModule_StringToLongLong(argv[++i], &direction) != REDISMODULE_OK || (direction != 1 && direction != 2))
+                return RedisModule_ReplyWithError(ctx, "ERR invalid DIRECTION parameter");
+        } else if (strcasecmp(option, "DEPTH") == 0 && i + 1 < argc) {
+            if (RedisModule_StringToLongLong(argv[++i], &depth) != REDISMODULE_OK || depth < 1 || depth > BILIST_WALK_DEPTH)
+                return RedisModule_ReplyWithError(ctx, "ERR invalid DEPTH parameter");
+        } else if (strcasecmp(option, "LIMIT") == 0 && i + 1 < argc) {
+            if (RedisModule_StringToLongLong(argv[++i], &limit) != REDISMODULE_OK)
+                return RedisModule_ReplyWithError(ctx, "ERR invalid LIMIT parameter");
+        } else if (strcasecmp(option, "EXCLUDE-START") == 0) {
+            exclude_start = 1;
+        } else if (strcasecmp(option, "WITHCOUNTS") == 0) {
+            withcounts = 1;
+        } else {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+    }
+
+    if (bilist_read_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (bilist == NULL || limit == 0) {
+        return RedisModule_ReplyWithArray(ctx, 0);
+    }
+
+    start.key = RedisModule_StringPtrLen(argv[2], &len);
+    start.len = len;
+    start.count = 1;
+    start.next = NULL;
+
+    // The start key can only come back after an even number of hops
+    exclude_start = exclude_start && depth % 2 == 0;
+
+    frontier = &start;
+    first = NULL;
+    found_count = 0;
+    pairs = 0;
+    secondary = direction == 2;
+    done = 0;
+
+    for (hop = 0; hop < depth && frontier && !done; hop++, secondary = !secondary) {
+        table_init(&seen);
+        first = last = NULL;
+        found_count = 0;
+
+        for (node = frontier; node && !done; node = node->next) {
+            slist_key(&key, node->key, node->len, NULL, 0);
+            if (!bilist_filter_partners(bilist, &key, secondary))
+                continue;
+
+            bilist_iter_init(&it, bilist, secondary);
+            bilist_iter_lower_bound(&it, &key);
+
+            for (; (partner = bilist_iter_key(&it)) && keycmp(partner, &key) == 0; bilist_iter_next(&it)) {
+                if (++pairs > BILIST_WALK_PAIRS) {
+                    table_free(&seen);
+                    return RedisModule_ReplyWithError(ctx, "ERR bilist.walk reads too many pairs, lower DEPTH");
+                }
+                if (bilist_node_expired(bilist_iter_binode(&it)))
+                    continue;
+
+                probe.key = partner->secondary_key;
+                probe.len = partner->secondary_len;
+                if (hop + 1 == depth && exclude_start && bilist_walk_match(&probe, &start))
+                    continue;
+
+                hash = table_hash(bilist_hash_seed, probe.key, probe.len, NULL, 0);
+                if (seen.size && (found = table_find(&seen, hash, bilist_walk_match, &probe))) {
+                    found->count = found->count > LLONG_MAX - node->count ? LLONG_MAX : found->count + node->count;
+                    continue;
+                }
+
+                found = RedisModule_PoolAlloc(ctx, sizeof(struct bilist_walk_node));
+                found->key = probe.key;
+                found->len = probe.len;
+                found->count = node->count;
+                found->index = found_count++;
+                found->next = NULL;
+                if (last)
+                    last->next = found;
+                else
+                    first = found;
+                last = found;
+                table_insert(&seen, hash, found);
+
+                // Counts need the whole last hop, plain keys only the first LIMIT
+                if (hop + 1 == depth && !withcounts && found_count == (unsigned long)limit) {
+                    done = 1;
+                    break;
+                }
+            }
+        }
+        table_free(&seen);
+        frontier = first;
+    }
+
+    // A walk that runs out of keys ends with an empty hop
+    elements = found_count;
+    if (limit >= 0 && elements > (unsigned long)limit)
+        elements = limit;
+
+    RedisModule_ReplyWithArray(ctx, elements);
+
+    if (elements == 0)
+        return REDISMODULE_OK;
+
+    if (!withcounts) {
+        for (node = first, n = 0; n < elements; node = node->next, n++)
+            RedisModule_ReplyWithStringBuffer(ctx, node->key, node->len);
+        return REDISMODULE_OK;
     }
 
-    return RedisModule_ReplyWithString(ctx, binode->value);
+    nodes = RedisModule_PoolAlloc(ctx, found_count * sizeof(struct bilist_walk_node *));
+    for (node = first, n = 0; node; node = node->next, n++)
+        nodes[n] = node;
+    qsort(nodes, found_count, sizeof(struct bilist_walk_node *), bilist_walk_cmp);
+
+    for (n = 0; n < elements; n++) {
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithStringBuffer(ctx, nodes[n]->key, nodes[n]->len);
+        RedisModule_ReplyWithLongLong(ctx, nodes[n]->count);
+    }
+    return REDISMODULE_OK;
 }
 
-int bilist_get1_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+int bilist_del_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
     struct bilist *bilist;
-    const char *key1;
-    size_t size;
+    struct s_key key;
+
+    struct binode * binode;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 4)
+        return RedisModule_WrongArity(ctx);
+
+    if (bilist_write_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (bilist == NULL) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    bilist_string_key(&key, argv[2], argv[3]);
+    binode = bilist_lookup(bilist, &key);
 
+    if (binode) {
+        bilist_delete_node(bilist, binode);
+        RedisModule_ReplicateVerbatim(ctx);
+        RedisModule_SignalModifiedKey(ctx, argv[1]);
+        bilist_delete_if_empty(ctx, argv[1], bilist);
+    }
+    return RedisModule_ReplyWithLongLong(ctx, binode?1:0);
+}
+
+/*
+ * bilist.mget list-name key1 key2 [key1 key2 ...]
+ * Replies with the values in argument order, nil for missing or expired pairs.
+ */
+int bilist_mget_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    struct bilist *bilist;
+    struct bilist_op *ops;
+    struct binode **found;
+
+    struct s_path path;
     struct s_node *node;
-    struct s_node *tmpnode;
+    struct binode *binode;
 
-    long elements;
+    long count;
+    long i;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 4 || argc % 2 != 0)
+        return RedisModule_WrongArity(ctx);
+
+    if (bilist_read_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    count = (argc - 2) / 2;
+
+    if (bilist == NULL) {
+        RedisModule_ReplyWithArray(ctx, count);
+        for (i = 0; i < count; i++)
+            RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
+    }
+
+    ops = RedisModule_PoolAlloc(ctx, count * sizeof(struct bilist_op));
+    found = RedisModule_PoolAlloc(ctx, count * sizeof(struct binode *));
+
+    for (i = 0; i < count; i++) {
+        bilist_string_key(&(ops[i].key), argv[2 + i*2], argv[2 + i*2 + 1]);
+        ops[i].index = i;
+    }
+    // Sorted, the skip list lookups continue from the path of the one before
+    if (count > 1 && !BILIST_HASHED(bilist))
+        qsort(ops, count, sizeof(struct bilist_op), bilist_op_cmp);
+
+    for (i = 0; i < count; i++) {
+        if (BILIST_COMPACT(bilist) || BILIST_HASHED(bilist)) {
+            binode = bilist_lookup(bilist, &(ops[i].key));
+        } else {
+            if (i == 0)
+                node = slist_path(bilist->primary_slist, &(ops[i].key), &path);
+            else
+                node = slist_path_next(bilist->primary_slist, &(ops[i].key), &path);
+            binode = node ? node->data : NULL;
+        }
+        if (binode && bilist_node_expired(binode))
+            binode = NULL;
+        found[ops[i].index] = binode;
+    }
+
+    RedisModule_ReplyWithArray(ctx, count);
+    for (i = 0; i < count; i++) {
+        if (found[i])
+            RedisModule_ReplyWithStringBuffer(ctx, BINODE_VALUE(found[i]), found[i]->value_len);
+        else
+            RedisModule_ReplyWithNull(ctx);
+    }
+    return REDISMODULE_OK;
+}
 
+/*
+ * bilist.mdel list-name key1 key2 [key1 key2 ...]
+ * Replies with the number of pairs deleted.
+ */
+int bilist_mdel_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    struct bilist *bilist;
+    struct bilist_op *ops;
+
+    struct s_path path;
+    struct s_node *node;
     struct binode *binode;
 
+    long count;
+    long deleted;
+    long i;
+
     RedisModule_AutoMemory(ctx);
 
-    if (argc != 3)
+    if (argc < 4 || argc % 2 != 0)
         return RedisModule_WrongArity(ctx);
 
-    bilist = bilist_get_from_key(ctx, argv[1]);
+    if (bilist_write_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
 
     if (bilist == NULL) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    count = (argc - 2) / 2;
+    ops = RedisModule_PoolAlloc(ctx, count * sizeof(struct bilist_op));
+
+    for (i = 0; i < count; i++) {
+        bilist_string_key(&(ops[i].key), argv[2 + i*2], argv[2 + i*2 + 1]);
+        ops[i].index = i;
+    }
+    if (count > 1)
+        qsort(ops, count, sizeof(struct bilist_op), bilist_op_cmp);
+
+    // Unlink from the primary index, keeping the binodes found at the front of ops
+    deleted = 0;
+    for (i = 0; i < count; i++) {
+        if (BILIST_COMPACT(bilist)) {
+            binode = sarray_delete(&(bilist->primary_array), &(ops[i].key));
+        } else {
+            if (i == 0)
+                node = slist_path(bilist->primary_slist, &(ops[i].key), &path);
+            else
+                node = slist_path_next(bilist->primary_slist, &(ops[i].key), &path);
+
+            binode = NULL;
+            if (node) {
+                binode = node->data;
+                slist_unlink(bilist->primary_slist, &path, node);
+            }
+        }
+
+        if (binode) {
+            ops[deleted].binode = binode;
+            ops[deleted].index = deleted;
+            bilist_secondary_key(&(ops[deleted].key), binode);
+            deleted++;
+        }
+    }
+
+    bilist_delete_ops(bilist, 1, ops, deleted);
+
+    if (deleted) {
+        RedisModule_ReplicateVerbatim(ctx);
+        RedisModule_SignalModifiedKey(ctx, argv[1]);
+        bilist_delete_if_empty(ctx, argv[1], bilist);
+    }
+    return RedisModule_ReplyWithLongLong(ctx, deleted);
+}
+
+/*
+ * Shared by del1 and del2: deletes every pair of argv[2]. Its run in list
+ * is cut out with one splice, the other index is then cleaned up in
+ * sorted order.
+ */
+int bilist_del_partners(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int secondary)
+{
+    struct bilist *bilist;
+    struct bilist_op *ops;
+    struct s_list *list;
+    struct s_array *array;
+
+    struct s_key key;
+    struct s_path from, to;
+    struct s_node *node;
+
+    u_int32_t first;
+    unsigned long count;
+    unsigned long i;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 3)
+        return RedisModule_WrongArity(ctx);
+
+    if (bilist_write_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    key1 = RedisModule_StringPtrLen(argv[2], &size);
+    if (bilist == NULL) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
 
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    list = secondary ? bilist->secondary_slist : bilist->primary_slist;
+    array = secondary ? &(bilist->secondary_array) : &(bilist->primary_array);
 
-    elements = 0;
+    bilist_string_key(&key, argv[2], NULL);
 
-    node = slist_find_first(bilist->primary_slist, key1);
+    node = NULL;
+    first = 0;
+    if (BILIST_COMPACT(bilist)) {
+        first = sarray_count_less(array, &key);
+        count = sarray_count_not_greater(array, &key) - first;
+    } else if (!bilist_filter_partners(bilist, &key, secondary)) {
+        count = 0;
+    } else {
+        slist_path(list, &key, &from);
+        slist_path_floor(list, &key, &to);
+        count = to.rank[0] - from.rank[0];
+        node = from.node[0]->level[0].next;
+    }
 
-    while (node && strcmp(node->primary_key, key1) == 0) {
-        tmpnode = node->next_n[0];
-        binode = node->data;
+    if (count == 0) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
 
-        if (bilist_node_expired(binode)) {
-            slist_delete(bilist->primary_slist, RedisModule_StringPtrLen(binode->key1, &size), RedisModule_StringPtrLen(binode->key2, & size));
-            slist_delete(bilist->secondary_slist, RedisModule_StringPtrLen(binode->key2, &size), RedisModule_StringPtrLen(binode->key1, &size));
-            bilist_remove_node(bilist, binode);
-            bilist->items--;
+    ops = RedisModule_PoolAlloc(ctx, count * sizeof(struct bilist_op));
+
+    for (i = 0; i < count; i++) {
+        if (node) {
+            ops[i].binode = node->data;
+            node = node->level[0].next;
         } else {
-            RedisModule_ReplyWithArray(ctx, 2);
-            RedisModule_ReplyWithString(ctx, binode->key2);
-            RedisModule_ReplyWithString(ctx, binode->value);
-            elements++;
+            ops[i].binode = array->entries[first + i].data;
         }
-        node = tmpnode;
+        ops[i].index = i;
+        if (secondary)
+            bilist_primary_key(&(ops[i].key), ops[i].binode);
+        else
+            bilist_secondary_key(&(ops[i].key), ops[i].binode);
     }
-    RedisModule_ReplySetArrayLength(ctx, elements);
-    return REDISMODULE_OK;
+
+    if (BILIST_COMPACT(bilist))
+        sarray_remove_range(array, first, first + count);
+    else
+        slist_unlink_range(list, &from, &to);
+    bilist_delete_ops(bilist, !secondary, ops, count);
+
+    RedisModule_ReplicateVerbatim(ctx);
+    RedisModule_SignalModifiedKey(ctx, argv[1]);
+    bilist_delete_if_empty(ctx, argv[1], bilist);
+    return RedisModule_ReplyWithLongLong(ctx, count);
 }
 
-int bilist_get2_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+int bilist_del1_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    return bilist_del_partners(ctx, argv, argc, 0);
+}
+
+int bilist_del2_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    return bilist_del_partners(ctx, argv, argc, 1);
+}
+
+int bilist_count_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
     struct bilist *bilist;
-    const char *key1;
-    size_t size;
 
-    struct s_node *node;
-    struct s_node *tmpnode;
+    RedisModule_AutoMemory(ctx);
 
-    long elements;
+    if (argc != 2)
+        return RedisModule_WrongArity(ctx);
 
-    struct binode *binode;
+    if (bilist_read_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (bilist == NULL) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    return RedisModule_ReplyWithLongLong(ctx, bilist->items);
+}
+
+int bilist_version_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    struct bilist *bilist;
 
     RedisModule_AutoMemory(ctx);
 
-    if (argc != 3)
+    if (argc != 2)
         return RedisModule_WrongArity(ctx);
 
-    bilist = bilist_get_from_key(ctx, argv[1]);
+    if (bilist_read_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
 
     if (bilist == NULL) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    return RedisModule_ReplyWithLongLong(ctx, bilist->version);
+}
+
+int bilist_all_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    struct bilist *bilist;
+    struct binode *binode;
+    long elements;
+
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 2)
+        return RedisModule_WrongArity(ctx);
+
+    if (bilist_read_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    key1 = RedisModule_StringPtrLen(argv[2], &size);
+    if (bilist == NULL) {
+        return RedisModule_ReplyWithArray(ctx, 0);
+    }
+    elements = 0;
+
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    for (binode = bilist->first; binode; binode = binode->next) {
+        if (bilist_node_expired(binode))
+            continue;
+
+        RedisModule_ReplyWithArray(ctx, 4);
+        RedisModule_ReplyWithStringBuffer(ctx, BINODE_KEY1(binode), binode->key1_len);
+        RedisModule_ReplyWithStringBuffer(ctx, BINODE_KEY2(binode), binode->key2_len);
+        RedisModule_ReplyWithStringBuffer(ctx, BINODE_VALUE(binode), binode->value_len);
+        RedisModule_ReplyWithLongLong(ctx, binode->expire.when?(binode->expire.when-RedisModule_Milliseconds())/1000:-1);
+        elements++;
+    }
+    RedisModule_ReplySetArrayLength(ctx, elements);
+    return REDISMODULE_OK;
+}
+
+/*
+ * Glob style matching as in SCAN: * ? [abc] [^a-z] and \ escapes.
+ */
+int bilist_match(const char *pattern, size_t plen, const char *string, size_t slen)
+{
+    int negate, match;
+    unsigned char lo, hi, c;
+
+    while (plen) {
+        switch (*pattern) {
+        case '*':
+            while (plen > 1 && pattern[1] == '*') {
+                pattern++;
+                plen--;
+            }
+            if (plen == 1)
+                return 1;
+            for (;;) {
+                if (bilist_match(pattern + 1, plen - 1, string, slen))
+                    return 1;
+                if (slen == 0)
+                    return 0;
+                string++;
+                slen--;
+            }
+        case '?':
+            if (slen == 0)
+                return 0;
+            break;
+        case '[':
+            if (slen == 0)
+                return 0;
+            pattern++;
+            plen--;
+            negate = plen && *pattern == '^';
+            if (negate) {
+                pattern++;
+                plen--;
+            }
+            c = *string;
+            match = 0;
+            while (plen && *pattern != ']') {
+                if (*pattern == '\\' && plen >= 2) {
+                    pattern++;
+                    plen--;
+                    if ((unsigned char)*pattern == c)
+                        match = 1;
+                } else if (plen >= 3 && pattern[1] == '-' && pattern[2] != ']') {
+                    lo = pattern[0];
+                    hi = pattern[2];
+                    if (lo > hi) {
+                        lo = pattern[2];
+                        hi = pattern[0];
+                    }
+                    if (c >= lo && c <= hi)
+                        match = 1;
+                    pattern += 2;
+                    plen -= 2;
+                } else if ((unsigned char)*pattern == c) {
+                    match = 1;
+                }
+                pattern++;
+                plen--;
+            }
+            if (match == negate)
+                return 0;
+            if (plen == 0) {
+                string++;
+                slen--;
+                continue;
+            }
+            break;
+        case '\\':
+            if (plen >= 2) {
+                pattern++;
+                plen--;
+            }
+            /* fall through */
+        default:
+            if (slen == 0 || *pattern != *string)
+                return 0;
+            break;
+        }
+        pattern++;
+        plen--;
+        string++;
+        slen--;
+    }
+    return slen == 0;
+}
+
+/*
+ * Length of the literal start of a glob pattern, every match begins with it.
+ */
+size_t bilist_match_prefix(const char *pattern, size_t plen)
+{
+    size_t i;
+
+    for (i = 0; i < plen; i++) {
+        if (memchr("*?[\\", pattern[i], 4))
+            break;
+    }
+    return i;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/*
+ * A scan cursor is the last pair returned: the length of key1 as 8 hex
+ * digits, then key1 and key2 in hex. "0" starts and ends a scan.
+ */
+RedisModuleString *bilist_cursor_encode(RedisModuleCtx *ctx, struct binode *binode)
+{
+    size_t len, i;
+    char *buffer;
+    char *ptr;
+    unsigned char c;
+
+    len = 8 + 2 * ((size_t)binode->key1_len + binode->key2_len);
+    buffer = RedisModule_PoolAlloc(ctx, len);
+
+    ptr = buffer;
+    for (i = 0; i < 8; i++)
+        *ptr++ = hex_digits[(binode->key1_len >> (28 - 4 * i)) & 0xf];
+    for (i = 0; i < (size_t)binode->key1_len + binode->key2_len; i++) {
+        c = binode->data[i];
+        *ptr++ = hex_digits[c >> 4];
+        *ptr++ = hex_digits[c & 0xf];
+    }
+    return RedisModule_CreateString(ctx, buffer, len);
+}
+
+int bilist_hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
 
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+/*
+ * Decodes cursor into key, key->primary_key is NULL for a new scan.
+ * The key bytes are pool allocated.
+ */
+int bilist_cursor_decode(RedisModuleCtx *ctx, RedisModuleString *cursor, struct s_key *key)
+{
+    const char *ptr;
+    char *buffer;
+    size_t len, i;
+    u_int64_t key1_len;
+    int hi, lo;
 
-    elements = 0;
+    ptr = RedisModule_StringPtrLen(cursor, &len);
 
-    node = slist_find_first(bilist->secondary_slist, key1);
+    if (len == 1 && ptr[0] == '0') {
+        key->primary_key = NULL;
+        return REDISMODULE_OK;
+    }
+    if (len < 8 || len % 2)
+        return REDISMODULE_ERR;
 
-    while (node && strcmp(node->primary_key, key1) == 0) {
-        tmpnode = node->next_n[0];
-        binode = node->data;
+    key1_len = 0;
+    for (i = 0; i < 8; i++) {
+        if ((hi = bilist_hex_value(ptr[i])) < 0)
+            return REDISMODULE_ERR;
+        key1_len = (key1_len << 4) | hi;
+    }
+    if (key1_len > (len - 8) / 2)
+        return REDISMODULE_ERR;
 
-        if (bilist_node_expired(binode)) {
-            slist_delete(bilist->primary_slist, RedisModule_StringPtrLen(binode->key1, &size), RedisModule_StringPtrLen(binode->key2, & size));
-            slist_delete(bilist->secondary_slist, RedisModule_StringPtrLen(binode->key2, &size), RedisModule_StringPtrLen(binode->key1, &size));
-            bilist_remove_node(bilist, binode);
-            bilist->items--;
-        } else {
-            RedisModule_ReplyWithArray(ctx, 2);
-            RedisModule_ReplyWithString(ctx, binode->key1);
-            RedisModule_ReplyWithString(ctx, binode->value);
-            elements++;
-        }
-        node = tmpnode;
+    buffer = RedisModule_PoolAlloc(ctx, (len - 8) / 2 + 1);
+    for (i = 0; i < (len - 8) / 2; i++) {
+        hi = bilist_hex_value(ptr[8 + 2 * i]);
+        lo = bilist_hex_value(ptr[8 + 2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return REDISMODULE_ERR;
+        buffer[i] = (hi << 4) | lo;
     }
-    RedisModule_ReplySetArrayLength(ctx, elements);
+
+    slist_key(key, buffer, key1_len, buffer + key1_len, (len - 8) / 2 - key1_len);
     return REDISMODULE_OK;
 }
 
-int bilist_del_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+/*
+ * bilist.scan list-name cursor [COUNT count] [MATCH pattern]
+ * Walks the pairs in primary key order, COUNT pairs per call. MATCH is
+ * applied to key1. The cursor is the last pair looked at, so it stays
+ * valid whatever is added or deleted between calls.
+ */
+int bilist_scan_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
     struct bilist *bilist;
-    const char *key1;
-    const char *key2;
-    size_t size;
+    struct s_key key;
 
-    struct binode * binode;
+    struct bilist_iter it;
+    struct binode *binode;
+    struct binode *last;
+    struct binode **found;
+
+    const char *option;
+    const char *pattern;
+    size_t pattern_len;
+    size_t prefix_len;
+
+    long long count;
+    long long examined;
+    long elements;
+    long i;
 
     RedisModule_AutoMemory(ctx);
 
-    if (argc != 4)
+    if (argc < 3 || argc % 2 == 0)
         return RedisModule_WrongArity(ctx);
 
-    bilist = bilist_get_from_key(ctx, argv[1]);
-
-    if (bilist == NULL) {
+    if (bilist_read_from_key(ctx, argv[1], &bilist) != REDISMODULE_OK) {
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    key1 = RedisModule_StringPtrLen(argv[2], &size);
-    key2 = RedisModule_StringPtrLen(argv[3], &size);
+    if (bilist_cursor_decode(ctx, argv[2], &key) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid cursor");
+    }
 
-    binode = slist_delete(bilist->primary_slist, key1, key2);
+    count = BILIST_SCAN_COUNT;
+    pattern = NULL;
+    pattern_len = 0;
 
-    if (binode) {
-        slist_delete(bilist->secondary_slist, key2, key1);
-        bilist_remove_node(bilist, binode);
-        bilist->items--;
+    for (i = 3; i < argc; i += 2) {
+        option = RedisModule_StringPtrLen(argv[i], NULL);
+        if (strcasecmp(option, "COUNT") == 0) {
+            if (RedisModule_StringToLongLong(argv[i+1], &count) != REDISMODULE_OK || count < 1) {
+                return RedisModule_ReplyWithError(ctx, "ERR invalid count parameter");
+            }
+        } else if (strcasecmp(option, "MATCH") == 0) {
+            pattern = RedisModule_StringPtrLen(argv[i+1], &pattern_len);
+        } else {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
     }
-    return RedisModule_ReplyWithLongLong(ctx, binode?1:0);
-}
 
-int bilist_count_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
-{
-    struct bilist *bilist;
+    if (bilist == NULL) {
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithStringBuffer(ctx, "0", 1);
+        return RedisModule_ReplyWithArray(ctx, 0);
+    }
 
-    RedisModule_AutoMemory(ctx);
+    bilist_iter_init(&it, bilist, 0);
 
-    if (argc != 2)
-        return RedisModule_WrongArity(ctx);
+    if (key.primary_key == NULL) {
+        bilist_iter_seek(&it, 1);
+    } else {
+        bilist_iter_lower_bound(&it, &key);
+        if (bilist_iter_key(&it) && keycmp(bilist_iter_key(&it), &key) == 0)
+            bilist_iter_next(&it);
+    }
 
-    bilist = bilist_get_from_key(ctx, argv[1]);
+    // Matches all start with the literal part of the pattern: seek to it
+    prefix_len = pattern ? bilist_match_prefix(pattern, pattern_len) : 0;
+    if (prefix_len) {
+        slist_key(&key, pattern, prefix_len, NULL, 0);
+        if (bilist_iter_key(&it) && keycmp(bilist_iter_key(&it), &key) < 0)
+            bilist_iter_lower_bound(&it, &key);
+    }
 
-    if (bilist == NULL) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    found = RedisModule_PoolAlloc(ctx, (count < (long long)bilist->items ? count : (long long)bilist->items) * sizeof(struct binode *));
+    elements = 0;
+    last = NULL;
+
+    for (examined = 0; (binode = bilist_iter_binode(&it)) && examined < count; examined++) {
+        if (prefix_len && (binode->key1_len < prefix_len || memcmp(BINODE_KEY1(binode), pattern, prefix_len) != 0)) {
+            binode = NULL;
+            break;
+        }
+        last = binode;
+        bilist_iter_next(&it);
+
+        if (bilist_node_expired(binode))
+            continue;
+        if (pattern && !bilist_match(pattern, pattern_len, BINODE_KEY1(binode), binode->key1_len))
+            continue;
+        found[elements++] = binode;
     }
 
-    return RedisModule_ReplyWithLongLong(ctx, bilist->items);
+    RedisModule_ReplyWithArray(ctx, 2);
+    if (binode)
+        RedisModule_ReplyWithString(ctx, bilist_cursor_encode(ctx, last));
+    else
+        RedisModule_ReplyWithStringBuffer(ctx, "0", 1);
+
+    RedisModule_ReplyWithArray(ctx, elements);
+    for (i = 0; i < elements; i++) {
+        binode = found[i];
+        RedisModule_ReplyWithArray(ctx, 4);
+        RedisModule_ReplyWithStringBuffer(ctx, BINODE_KEY1(binode), binode->key1_len);
+        RedisModule_ReplyWithStringBuffer(ctx, BINODE_KEY2(binode), binode->key2_len);
+        RedisModule_ReplyWithStringBuffer(ctx, BINODE_VALUE(binode), binode->value_len);
+        RedisModule_ReplyWithLongLong(ctx, binode->expire.when?(binode->expire.when-RedisModule_Milliseconds())/1000:-1);
+    }
+    return REDISMODULE_OK;
 }
 
-int bilist_all_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+/* ========================== "bilist" type methods ======================= */
+
+/*
+ * Encoding version 0: pairs in insertion order, keys saved in full
+ */
+struct bilist *bilist_load_unsorted(RedisModuleIO *rdb)
 {
+    unsigned long i;
+    unsigned long elements;
+
     struct bilist *bilist;
     struct binode *binode;
-    long elements;
+    struct binode *prev;
 
-    size_t size;
+    char *key1, *key2, *value;
+    size_t key1_len, key2_len, value_len;
 
-    RedisModule_AutoMemory(ctx);
+    bilist = bilist_create();
 
-    if (argc != 2)
-        return RedisModule_WrongArity(ctx);
+    bilist->counter = RedisModule_LoadUnsigned(rdb);
+    bilist->increment = RedisModule_LoadUnsigned(rdb);
+    bilist->items = RedisModule_LoadUnsigned(rdb);
+    bilist->prand.state.a = RedisModule_LoadUnsigned(rdb);
 
-    bilist = bilist_get_from_key(ctx, argv[1]);
+    if (bilist->items > (unsigned long long)bilist_compact_entries)
+        bilist_expand(bilist);
 
-    if (bilist == NULL) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
-    }
+    prev = NULL;
     elements = 0;
 
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-    for (binode = bilist->first; binode; binode = binode->next) {
+    for (i=0; i < bilist->items; i++) {
+
+        key1 = RedisModule_LoadStringBuffer(rdb, &key1_len);
+        key2 = RedisModule_LoadStringBuffer(rdb, &key2_len);
+        value = RedisModule_LoadStringBuffer(rdb, &value_len);
+
+        binode = bilist_alloc_node(bilist, key1, key1_len, key2, key2_len, value, value_len, RedisModule_LoadSigned(rdb));
+
+        FREE(key1);
+        FREE(key2);
+        FREE(value);
+
         if (bilist_node_expired(binode)) {
-            slist_delete(bilist->primary_slist, RedisModule_StringPtrLen(binode->key1, &size), RedisModule_StringPtrLen(binode->key2, & size));
-            slist_delete(bilist->secondary_slist, RedisModule_StringPtrLen(binode->key2, &size), RedisModule_StringPtrLen(binode->key1, &size));
-            bilist_remove_node(bilist, binode);
-            bilist->items--;
+            bilist_data_free(bilist, binode);
         } else {
-            RedisModule_ReplyWithArray(ctx, 4);
-            RedisModule_ReplyWithString(ctx, binode->key1);
-            RedisModule_ReplyWithString(ctx, binode->key2);
-            RedisModule_ReplyWithString(ctx, binode->value);
-            RedisModule_ReplyWithLongLong(ctx, binode->expire_time?(binode->expire_time-RedisModule_Milliseconds())/1000:-1);
             elements++;
+            if (prev) {
+                prev->next = binode;
+                binode->prev = prev;
+            } else {
+                bilist->first = binode;
+            }
+            if (binode->expire.when)
+                heap_push(&(bilist->expires), &(binode->expire));
+            bilist_index_node(bilist, binode);
+
+            prev = binode;
         }
     }
-    RedisModule_ReplySetArrayLength(ctx, elements);
-    return REDISMODULE_OK;
+
+    bilist->items = elements;
+
+    if (heap_top(&(bilist->expires)))
+        bilist_schedule(bilist);
+
+    return bilist;
 }
 
-/* ========================== "bilist" type methods ======================= */
+/*
+ * Keys are front coded: the length of the prefix shared with the key of
+ * the previous pair, then the rest. Pairs are saved in primary order, so
+ * key1 mostly repeats.
+ */
+void bilist_save_key(RedisModuleIO *rdb, const char *prev, size_t prev_len, const char *key, size_t len)
+{
+    size_t shared = 0;
 
-void *bilistRdbLoad(RedisModuleIO *rdb, int encver)
+    while (shared < prev_len && shared < len && prev[shared] == key[shared])
+        shared++;
+    RedisModule_SaveUnsigned(rdb, shared);
+    RedisModule_SaveStringBuffer(rdb, key + shared, len - shared);
+}
+
+/*
+ * Replaces the previous key in *key with the next one
+ */
+int bilist_load_key(RedisModuleIO *rdb, char **key, size_t *len, size_t *alloc)
 {
-    if (encver != 0) {
-        /* RedisModule_Log("warning","Can't load data with version %d", encver);*/
-        return NULL;
+    size_t shared, rest_len;
+    char *rest;
+
+    shared = RedisModule_LoadUnsigned(rdb);
+    rest = RedisModule_LoadStringBuffer(rdb, &rest_len);
+    if (shared > *len) {
+        FREE(rest);
+        return REDISMODULE_ERR;
+    }
+    // Allocated even for an empty first key, the binode copies it with memcpy
+    if (*key == NULL || shared + rest_len > *alloc) {
+        *alloc = (shared + rest_len) * 2;
+        if (*alloc < 16)
+            *alloc = 16;
+        *key = REALLOC(*key, *alloc);
     }
+    memcpy(*key + shared, rest, rest_len);
+    *len = shared + rest_len;
+    FREE(rest);
+    return REDISMODULE_OK;
+}
 
+/*
+ * Encoding version 1: pairs in primary order with front coded keys. The
+ * expire time is saved as the zigzag encoded difference to the previous
+ * one, plus 1 so that 0 means none: expire times lie close together and
+ * small numbers take fewer bytes. The primary index is built by appending,
+ * then the secondary one from the binodes sorted by secondary key. The
+ * version is saved with the generator, so it never goes back on a reload.
+ */
+struct bilist *bilist_load_sorted(RedisModuleIO *rdb)
+{
     unsigned long i;
     unsigned long elements;
 
     struct bilist *bilist;
     struct binode *binode;
     struct binode *prev;
+    struct s_path path;
+    struct s_key key;
 
-    size_t size;
+    char *key1 = NULL, *key2 = NULL, *value;
+    size_t key1_len = 0, key2_len = 0, value_len;
+    size_t key1_alloc = 0, key2_alloc = 0;
+    u_int64_t saved, delta;
+    long long when = 0;
 
     bilist = bilist_create();
 
@@ -589,67 +2586,172 @@ void *bilistRdbLoad(RedisModuleIO *rdb, int encver)
     bilist->increment = RedisModule_LoadUnsigned(rdb);
     bilist->items = RedisModule_LoadUnsigned(rdb);
     bilist->prand.state.a = RedisModule_LoadUnsigned(rdb);
+    bilist->version = RedisModule_LoadUnsigned(rdb);
+
+    if (bilist->items > (unsigned long long)bilist_compact_entries)
+        bilist_expand(bilist);
+    if (!BILIST_COMPACT(bilist))
+        slist_path_tail(bilist->primary_slist, &path);
 
     prev = NULL;
     elements = 0;
 
     for (i=0; i < bilist->items; i++) {
 
-        binode = MALLOC(sizeof (struct binode));
+        if (bilist_load_key(rdb, &key1, &key1_len, &key1_alloc) != REDISMODULE_OK ||
+            bilist_load_key(rdb, &key2, &key2_len, &key2_alloc) != REDISMODULE_OK) {
+            RedisModule_LogIOError(rdb, "warning", "bilist: corrupt key prefix");
+            bilist->items = elements;
+            bilist_release(bilist);
+            bilist = NULL;
+            break;
+        }
+        value = RedisModule_LoadStringBuffer(rdb, &value_len);
+
+        // An unchanged expire time is saved as 1, only 0 means none
+        saved = RedisModule_LoadUnsigned(rdb);
+        if (saved) {
+            delta = saved - 1;
+            when += (delta & 1) ? ~(long long)(delta >> 1) : (long long)(delta >> 1);
+        }
+
+        binode = bilist_alloc_node(bilist, key1, key1_len, key2, key2_len, value, value_len, saved ? when : 0);
 
-        binode->key1 = RedisModule_LoadString(rdb);
-        binode->key2 = RedisModule_LoadString(rdb);
-        binode->value = RedisModule_LoadString(rdb);
-        binode->expire_time = RedisModule_LoadSigned(rdb);
-        binode->next = NULL;
-        binode->prev = NULL;
+        FREE(value);
 
         if (bilist_node_expired(binode)) {
-            bilist_data_free(binode);
-        } else {
-            elements++;
-            if (prev) {
-                prev->next = binode;
-                binode->prev = prev;
-            } else {
-                bilist->first = binode;
-                bilist->next_prune = binode;
-            }
-            slist_insert(bilist->primary_slist, RedisModule_StringPtrLen(binode->key1, &size), RedisModule_StringPtrLen(binode->key2, &size), NULL);
-            slist_insert(bilist->secondary_slist, RedisModule_StringPtrLen(binode->key2, &size), RedisModule_StringPtrLen(binode->key1, &size), binode);
+            bilist_data_free(bilist, binode);
+            continue;
+        }
 
-            prev = binode;
+        elements++;
+        if (prev) {
+            prev->next = binode;
+            binode->prev = prev;
+        } else {
+            bilist->first = binode;
         }
+        if (binode->expire.when)
+            heap_push(&(bilist->expires), &(binode->expire));
+
+        bilist_primary_key(&key, binode);
+        if (BILIST_COMPACT(bilist))
+            sarray_insert_at(&(bilist->primary_array), bilist->primary_array.size, &key, binode);
+        else
+            slist_append(bilist->primary_slist, &path, &key, binode);
+        bilist_hash_node(bilist, binode);
+
+        prev = binode;
     }
 
+    if (key1)
+        FREE(key1);
+    if (key2)
+        FREE(key2);
+    if (bilist == NULL)
+        return NULL;
+
     bilist->items = elements;
+    if (bilist_defer_secondary)
+        bilist->secondary_pending = 1;
+    else
+        bilist_build_secondary(bilist);
+
+    if (heap_top(&(bilist->expires)))
+        bilist_schedule(bilist);
+
+    return bilist;
+}
+
+void *bilistRdbLoad(RedisModuleIO *rdb, int encver)
+{
+    struct bilist *bilist;
+    const RedisModuleString *keyname;
+
+    switch (encver) {
+    case 0:
+        bilist = bilist_load_unsorted(rdb);
+        break;
+    case 1:
+        bilist = bilist_load_sorted(rdb);
+        break;
+    default:
+        return NULL;
+    }
 
+    if (bilist && (keyname = RedisModule_GetKeyNameFromIO(rdb)))
+        bilist_set_name(bilist, keyname, RedisModule_GetDbIdFromIO(rdb));
     return bilist;
 }
 
 void bilistRdbSave(RedisModuleIO *rdb, void *value) {
     struct bilist *bilist = (struct bilist *)value;
+    struct bilist_iter it;
     struct binode *node;
+    struct binode *prev;
+    long long when = 0;
+    long long delta;
 
     RedisModule_SaveUnsigned(rdb, bilist->counter);
     RedisModule_SaveUnsigned(rdb, bilist->increment);
     RedisModule_SaveUnsigned(rdb, bilist->items);
     RedisModule_SaveUnsigned(rdb, bilist->prand.state.a);
+    RedisModule_SaveUnsigned(rdb, bilist->version);
 
-    for (node = bilist->first;node;node = node->next) {
-        RedisModule_SaveString(rdb, node->key1);
-        RedisModule_SaveString(rdb, node->key2);
-        RedisModule_SaveString(rdb, node->value);
-        RedisModule_SaveSigned(rdb, node->expire_time);
+    prev = NULL;
+    bilist_iter_init(&it, bilist, 0);
+    for (bilist_iter_seek(&it, 1); (node = bilist_iter_binode(&it)); bilist_iter_next(&it)) {
+        bilist_save_key(rdb, prev ? BINODE_KEY1(prev) : NULL, prev ? prev->key1_len : 0, BINODE_KEY1(node), node->key1_len);
+        bilist_save_key(rdb, prev ? BINODE_KEY2(prev) : NULL, prev ? prev->key2_len : 0, BINODE_KEY2(node), node->key2_len);
+        RedisModule_SaveStringBuffer(rdb, BINODE_VALUE(node), node->value_len);
+        if (node->expire.when) {
+            delta = node->expire.when - when;
+            RedisModule_SaveUnsigned(rdb, (((u_int64_t)delta << 1) ^ (u_int64_t)(delta >> 63)) + 1);
+            when = node->expire.when;
+        } else {
+            RedisModule_SaveUnsigned(rdb, 0);
+        }
+        prev = node;
     }
 }
 
+/*
+ * Emits the pairs in primary order as bilist.mset PXAT commands of up to
+ * BILIST_AOF_BATCH pairs each, with absolute expire times, then the
+ * generator of bilist.ckey and the version as bilist.seed, last so that
+ * the msets do not move the version on.
+ */
 void bilistAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value)
 {
-    REDISMODULE_NOT_USED(aof);
-    REDISMODULE_NOT_USED(key);
-    REDISMODULE_NOT_USED(value);
+    struct bilist *bilist = (struct bilist *)value;
+    struct bilist_iter it;
+    struct binode *node;
+    RedisModuleString *args[BILIST_AOF_BATCH * 4];
+    int i, n;
+
+    n = 0;
+    bilist_iter_init(&it, bilist, 0);
+    for (bilist_iter_seek(&it, 1); ; bilist_iter_next(&it)) {
+        node = bilist_iter_binode(&it);
+        if (node && !bilist_node_expired(node)) {
+            args[n++] = RedisModule_CreateString(NULL, BINODE_KEY1(node), node->key1_len);
+            args[n++] = RedisModule_CreateString(NULL, BINODE_KEY2(node), node->key2_len);
+            args[n++] = RedisModule_CreateString(NULL, BINODE_VALUE(node), node->value_len);
+            args[n++] = RedisModule_CreateStringFromLongLong(NULL, node->expire.when);
+        }
+        if (n && (node == NULL || n == BILIST_AOF_BATCH * 4)) {
+            RedisModule_EmitAOF(aof, "bilist.mset", "scv", key, "PXAT", args, (size_t)n);
+            for (i = 0; i < n; i++)
+                RedisModule_FreeString(NULL, args[i]);
+            n = 0;
+        }
+        if (node == NULL)
+            break;
+    }
 
+    RedisModule_EmitAOF(aof, "bilist.seed", "sllll", key, (long long)bilist->counter,
+                        (long long)bilist->increment, (long long)bilist->prand.state.a,
+                        (long long)bilist->version);
 }
 
 /* The goal of this function is to return the amount of memory used by
@@ -657,8 +2759,12 @@ void bilistAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value)
 size_t bilistMemUsage(const void *value)
 {
     const struct bilist *bilist = (struct bilist *)value;
+    size_t size;
 
-    return sizeof(struct bilist)+2*sizeof(struct s_list)+(bilist->items)*(sizeof(struct binode)+2*sizeof(struct s_node));
+    size = sizeof(struct bilist)+pool_mem_usage(&(bilist->pool))+sarray_mem_usage(&(bilist->primary_array))+sarray_mem_usage(&(bilist->secondary_array))+heap_mem_usage(&(bilist->expires))+table_mem_usage(&(bilist->table))+bloom_mem_usage(&(bilist->filter));
+    if (!BILIST_COMPACT(bilist))
+        size += 2*sizeof(struct s_list);
+    return size;
 }
 
 void bilistFree(void *value)
@@ -666,21 +2772,333 @@ void bilistFree(void *value)
     bilist_release(value);
 }
 
+/*
+ * Releasing a bilist frees the slabs and large chunks of its pool, not
+ * every pair, plus a few arrays. Above the lazyfree threshold Redis frees
+ * it in a background thread after calling bilistUnlink.
+ */
+size_t bilistFreeEffort(RedisModuleString *key, const void *value)
+{
+    const struct bilist *bilist = (struct bilist *)value;
+
+    REDISMODULE_NOT_USED(key);
+
+    return pool_blocks(&(bilist->pool)) + 6;
+}
+
+/*
+ * Called on the main thread when the key is deleted or overwritten, before
+ * the value is freed: the scheduler is shared and must not be touched from
+ * the lazyfree thread.
+ */
+void bilistUnlink(RedisModuleString *key, const void *value)
+{
+    REDISMODULE_NOT_USED(key);
+
+    bilist_unschedule((struct bilist *)value);
+}
+
+/*
+ * FLUSHDB ASYNC and FLUSHALL ASYNC free the values in a background thread
+ * without unlinking them first, so the bilists of the flushed databases
+ * leave the scheduler beforehand. So do those without a name, whose
+ * database is unknown: they are scheduled again once a command names them.
+ */
+void bilist_flush_handler(RedisModuleCtx *ctx, RedisModuleEvent e, uint64_t subevent, void *data)
+{
+    RedisModuleFlushInfo *info = data;
+    struct bilist *bilist, *next;
+
+    REDISMODULE_NOT_USED(ctx);
+    REDISMODULE_NOT_USED(e);
+
+    if (subevent != REDISMODULE_SUBEVENT_FLUSHDB_START || info->sync)
+        return;
+    for (bilist = expire_first; bilist; bilist = next) {
+        next = bilist->expire_next;
+        if (info->dbnum == -1 || bilist->name == NULL || bilist->db == info->dbnum)
+            bilist_unschedule(bilist);
+    }
+}
+
+/*
+ * SWAPDB moves the scheduled bilists along with their databases. The others
+ * pick up their database on their next write, before they are scheduled.
+ */
+void bilist_swapdb_handler(RedisModuleCtx *ctx, RedisModuleEvent e, uint64_t subevent, void *data)
+{
+    RedisModuleSwapDbInfo *info = data;
+    struct bilist *bilist;
+
+    REDISMODULE_NOT_USED(ctx);
+    REDISMODULE_NOT_USED(e);
+    REDISMODULE_NOT_USED(subevent);
+
+    for (bilist = expire_first; bilist; bilist = bilist->expire_next) {
+        if (bilist->db == info->dbnum_first)
+            bilist->db = info->dbnum_second;
+        else if (bilist->db == info->dbnum_second)
+            bilist->db = info->dbnum_first;
+    }
+}
+
+/*
+ * RENAME and MOVE take the value to another key, its name follows.
+ */
+int bilist_keyspace_handler(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *keyname)
+{
+    struct bilist *bilist;
+
+    REDISMODULE_NOT_USED(type);
+
+    if (strcmp(event, "rename_to") != 0 && strcmp(event, "move_to") != 0)
+        return REDISMODULE_OK;
+    if (bilist_read_from_key(ctx, keyname, &bilist) == REDISMODULE_OK && bilist)
+        bilist_set_name(bilist, keyname, RedisModule_GetSelectedDb(ctx));
+    return REDISMODULE_OK;
+}
+
+/*
+ * Moves the bilist itself and its arrays, fixing up whatever points at
+ * them. Returns the bilist at its new address.
+ */
+struct bilist *bilist_defrag_struct(RedisModuleDefragCtx *ctx, struct bilist *bilist)
+{
+    struct bilist *moved;
+    void *ptr;
+
+    if ((moved = RedisModule_DefragAlloc(ctx, bilist))) {
+        if (expire_cursor == bilist)
+            expire_cursor = moved;
+        bilist = moved;
+        if (bilist->scheduled) {
+            if (bilist->expire_prev)
+                bilist->expire_prev->expire_next = bilist;
+            else
+                expire_first = bilist;
+            if (bilist->expire_next)
+                bilist->expire_next->expire_prev = bilist;
+        }
+    }
+
+    if (!BILIST_COMPACT(bilist)) {
+        if ((ptr = RedisModule_DefragAlloc(ctx, bilist->primary_slist)))
+            bilist->primary_slist = ptr;
+        if ((ptr = RedisModule_DefragAlloc(ctx, bilist->secondary_slist)))
+            bilist->secondary_slist = ptr;
+        bilist->primary_slist->pool = &(bilist->pool);
+        bilist->secondary_slist->pool = &(bilist->pool);
+    }
+    if (bilist->primary_array.entries && (ptr = RedisModule_DefragAlloc(ctx, bilist->primary_array.entries)))
+        bilist->primary_array.entries = ptr;
+    if (bilist->secondary_array.entries && (ptr = RedisModule_DefragAlloc(ctx, bilist->secondary_array.entries)))
+        bilist->secondary_array.entries = ptr;
+    if (bilist->expires.nodes && (ptr = RedisModule_DefragAlloc(ctx, bilist->expires.nodes)))
+        bilist->expires.nodes = ptr;
+    if (bilist->table.slots && (ptr = RedisModule_DefragAlloc(ctx, bilist->table.slots)))
+        bilist->table.slots = ptr;
+    if (bilist->filter.bits && (ptr = RedisModule_DefragAlloc(ctx, bilist->filter.bits)))
+        bilist->filter.bits = ptr;
+    if (bilist->name)
+        bilist->name = RedisModule_DefragRedisModuleString(ctx, bilist->name);
+
+    return bilist;
+}
+
+/*
+ * Moves a binode and its skip list nodes out of the evacuated slabs. The
+ * index entries are looked up first, while the keys they point to are
+ * still at their old address.
+ */
+void bilist_defrag_binode(RedisModuleDefragCtx *ctx, struct bilist *bilist, struct binode *binode)
+{
+    struct s_key key1, key2;
+    struct s_entry *entry1 = NULL, *entry2 = NULL;
+    struct s_path path1, path2;
+    struct s_node *node1 = NULL, *node2 = NULL;
+    struct s_node *node;
+    struct binode *moved;
+
+    bilist_primary_key(&key1, binode);
+    bilist_secondary_key(&key2, binode);
+    // entry2 and node2 stay NULL while the secondary index is deferred
+    if (BILIST_COMPACT(bilist)) {
+        entry1 = sarray_find(&(bilist->primary_array), &key1);
+        entry2 = sarray_find(&(bilist->secondary_array), &key2);
+    } else {
+        node1 = slist_path(bilist->primary_slist, &key1, &path1);
+        node2 = slist_path(bilist->secondary_slist, &key2, &path2);
+    }
+
+    if ((moved = pool_defrag(ctx, &(bilist->pool), binode, BINODE_SIZE(binode)))) {
+        if (moved->prev)
+            moved->prev->next = moved;
+        else
+            bilist->first = moved;
+        if (moved->next)
+            moved->next->prev = moved;
+        if (moved->expire.index)
+            bilist->expires.nodes[moved->expire.index] = &(moved->expire);
+        if (BILIST_HASHED(bilist))
+            table_replace(&(bilist->table), bilist_node_hash(moved), binode, moved);
+
+        bilist_primary_key(&key1, moved);
+        bilist_secondary_key(&key2, moved);
+        if (BILIST_COMPACT(bilist)) {
+            entry1->key = key1;
+            entry1->data = moved;
+            if (entry2) {
+                entry2->key = key2;
+                entry2->data = moved;
+            }
+        } else {
+            node1->key = key1;
+            node1->data = moved;
+            if (node2) {
+                node2->key = key2;
+                node2->data = moved;
+            }
+        }
+    }
+
+    if (!BILIST_COMPACT(bilist)) {
+        if ((node = pool_defrag(ctx, &(bilist->pool), node1, S_NODE_SIZE(node1->height))))
+            slist_relink(&path1, node);
+        if (node2 && (node = pool_defrag(ctx, &(bilist->pool), node2, S_NODE_SIZE(node2->height))))
+            slist_relink(&path2, node);
+    }
+}
+
+/*
+ * Active defrag. When enough of the pool sits idle in freed chunks, its
+ * slabs are evacuated and every binode and skip list node is copied to
+ * fresh ones. The pass is resumable: it goes down the binode list from
+ * defrag_next, and binodes added meanwhile are at the front, already in
+ * the new slabs. A binode that replaces a pair behind defrag_next takes
+ * over its skip list nodes, which are still in the old slabs, so while
+ * the pool is evacuating every call that finds the pass done starts
+ * another one from the front.
+ */
+int bilistDefrag(RedisModuleDefragCtx *ctx, RedisModuleString *key, void **value)
+{
+    struct bilist *bilist;
+    struct binode *binode;
+    struct s_node *head;
+    unsigned long cursor;
+
+    REDISMODULE_NOT_USED(key);
+
+    bilist = bilist_defrag_struct(ctx, *value);
+    *value = bilist;
+
+    if (!pool_evacuating(&(bilist->pool))) {
+        if (!pool_fragmented(&(bilist->pool)))
+            return 0;
+        pool_evacuate(&(bilist->pool));
+        if (!BILIST_COMPACT(bilist)) {
+            if ((head = pool_defrag(ctx, &(bilist->pool), bilist->primary_slist->head, S_NODE_SIZE(S_HEIGHT))))
+                bilist->primary_slist->head = head;
+            if ((head = pool_defrag(ctx, &(bilist->pool), bilist->secondary_slist->head, S_NODE_SIZE(S_HEIGHT))))
+                bilist->secondary_slist->head = head;
+        }
+    }
+    if (bilist->defrag_next == NULL)
+        bilist->defrag_next = bilist->first;
+
+    // The cursor only counts binodes, the position is kept in defrag_next
+    if (RedisModule_DefragCursorGet(ctx, &cursor) != REDISMODULE_OK)
+        cursor = 0;
+
+    while ((binode = bilist->defrag_next) && pool_evacuating(&(bilist->pool))) {
+        bilist->defrag_next = binode->next;
+        bilist_defrag_binode(ctx, bilist, binode);
+        if (++cursor % BILIST_DEFRAG_BATCH == 0 && RedisModule_DefragShouldStop(ctx)) {
+            RedisModule_DefragCursorSet(ctx, cursor);
+            return 1;
+        }
+    }
+    bilist->defrag_next = NULL;
+    return 0;
+}
+
 void bilistDigest(RedisModuleDigest *md, void *value)
 {
         REDISMODULE_NOT_USED(md);
         REDISMODULE_NOT_USED(value);
 }
 
+/*
+ * Module arguments come in name value pairs:
+ *   expire-budget <microseconds> - active expiry time per timer tick
+ *   compact-entries <count>      - largest bilist kept in the compact encoding
+ *   defer-secondary <0|1>        - build the secondary index of a loaded bilist on first use
+ *   hash-index <0|1>             - index the pairs of skip list bilists in a hash table too
+ *   filter-fp <ppm>              - false positives per million of the Bloom filters, 0 for none
+ *   filter-max-bytes <bytes>     - largest Bloom filter of a bilist, 0 for no limit
+ */
+int bilist_parse_args(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    const char *name;
+    long long value;
+    int i;
+
+    for (i = 0; i < argc; i += 2) {
+        name = RedisModule_StringPtrLen(argv[i], NULL);
+        if (i + 1 >= argc || RedisModule_StringToLongLong(argv[i+1], &value) != REDISMODULE_OK) {
+            RedisModule_Log(ctx, "warning", "bilist: invalid value for module argument '%s'", name);
+            return REDISMODULE_ERR;
+        }
+        if (strcasecmp(name, "expire-budget") == 0 && value > 0) {
+            bilist_expire_budget = value;
+        } else if (strcasecmp(name, "compact-entries") == 0 && value >= 0) {
+            bilist_compact_entries = value;
+        } else if (strcasecmp(name, "defer-secondary") == 0 && (value == 0 || value == 1)) {
+            bilist_defer_secondary = value;
+        } else if (strcasecmp(name, "hash-index") == 0 && (value == 0 || value == 1)) {
+            bilist_hash_index = value;
+        } else if (strcasecmp(name, "filter-fp") == 0 && value >= 0 && value < 1000000) {
+            bilist_filter_fp = value;
+        } else if (strcasecmp(name, "filter-max-bytes") == 0 && value >= 0) {
+            bilist_filter_max_bytes = value;
+        } else {
+            RedisModule_Log(ctx, "warning", "bilist: invalid module argument '%s'", name);
+            return REDISMODULE_ERR;
+        }
+    }
+    if (bilist_filter_fp) {
+        bilist_filter_bits = bloom_bits_per_entry(bilist_filter_fp / 1e6);
+        bilist_filter_probes = bloom_probes(bilist_filter_bits);
+    }
+    return REDISMODULE_OK;
+}
+
+/*
+ * The bilist section of INFO, with how many lookups the filters answered
+ */
+void bilist_info_handler(RedisModuleInfoCtx *ctx, int for_crash_report)
+{
+    REDISMODULE_NOT_USED(for_crash_report);
+
+    RedisModule_InfoAddSection(ctx, "filter");
+    RedisModule_InfoAddFieldLongLong(ctx, "fp_ppm", bilist_filter_fp);
+    RedisModule_InfoAddFieldULongLong(ctx, "bits_per_entry", bilist_filter_bits);
+    RedisModule_InfoAddFieldULongLong(ctx, "probes", bilist_filter_probes);
+    RedisModule_InfoAddFieldLongLong(ctx, "checks", bilist_filter_checks);
+    RedisModule_InfoAddFieldLongLong(ctx, "negatives", bilist_filter_negatives);
+}
+
 /* This function must be present on each Redis module. It is used in order to
  * register the commands into the Redis server. */
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
-
     if (RedisModule_Init(ctx,"bilist-jt",1,REDISMODULE_APIVER_1)
         == REDISMODULE_ERR) return REDISMODULE_ERR;
 
+    if (bilist_parse_args(ctx, argv, argc) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    // Hashes differ between runs, so colliding keys cannot be prepared
+    bilist_hash_seed = (u_int64_t)RedisModule_Milliseconds() ^ (RedisModule_MonotonicMicroseconds() << 20);
+
     RedisModuleTypeMethods tm = {
         .version = REDISMODULE_TYPE_METHOD_VERSION,
         .rdb_load = bilistRdbLoad,
@@ -688,27 +3106,64 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         .aof_rewrite = bilistAofRewrite,
         .mem_usage = bilistMemUsage,
         .free = bilistFree,
-        .digest = bilistDigest
+        .digest = bilistDigest,
+        .free_effort = bilistFreeEffort,
+        .unlink = bilistUnlink,
+        .defrag = bilistDefrag
     };
 
-    bilist_type = RedisModule_CreateDataType(ctx,"bilist-jt",0,&tm);
+    bilist_type = RedisModule_CreateDataType(ctx,"bilist-jt",BILIST_ENCODING_VERSION,&tm);
     if (bilist_type == NULL) return REDISMODULE_ERR;
 
+    if (RedisModule_RegisterInfoFunc(ctx, bilist_info_handler) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    RedisModule_CreateTimer(ctx, BILIST_TIMER_PERIOD, bilist_timer_handler, NULL);
+    RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_FlushDB, bilist_flush_handler);
+    RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_SwapDB, bilist_swapdb_handler);
+    RedisModule_SubscribeToKeyspaceEvents(ctx, REDISMODULE_NOTIFY_GENERIC, bilist_keyspace_handler);
+
     if (RedisModule_CreateCommand(ctx,"bilist.ckey", bilist_ckey_RedisCommand, "write deny-oom random",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.seed", bilist_seed_RedisCommand, "write deny-oom fast",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
     if (RedisModule_CreateCommand(ctx,"bilist.set", bilist_set_RedisCommand, "write deny-oom",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx,"bilist.get", bilist_get_RedisCommand, "write deny-oom",1,1,1) == REDISMODULE_ERR)
+    if (RedisModule_CreateCommand(ctx,"bilist.get", bilist_get_RedisCommand, "readonly fast",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx,"bilist.get1", bilist_get1_RedisCommand, "write deny-oom",1,1,1) == REDISMODULE_ERR)
+    if (RedisModule_CreateCommand(ctx,"bilist.get1", bilist_get1_RedisCommand, "readonly",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx,"bilist.get2", bilist_get2_RedisCommand, "write deny-oom",1,1,1) == REDISMODULE_ERR)
+    if (RedisModule_CreateCommand(ctx,"bilist.get2", bilist_get2_RedisCommand, "readonly deny-oom",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
     if (RedisModule_CreateCommand(ctx,"bilist.del", bilist_del_RedisCommand, "write deny-oom",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx,"bilist.count", bilist_count_RedisCommand, "readonly",1,1,1) == REDISMODULE_ERR)
+    if (RedisModule_CreateCommand(ctx,"bilist.count", bilist_count_RedisCommand, "readonly fast",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.all", bilist_all_RedisCommand, "readonly",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.version", bilist_version_RedisCommand, "readonly fast",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.mset", bilist_mset_RedisCommand, "write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.mget", bilist_mget_RedisCommand, "readonly",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.mdel", bilist_mdel_RedisCommand, "write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.del1", bilist_del1_RedisCommand, "write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.del2", bilist_del2_RedisCommand, "write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.scan", bilist_scan_RedisCommand, "readonly",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.count1", bilist_count1_RedisCommand, "readonly fast",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.count2", bilist_count2_RedisCommand, "readonly deny-oom fast",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.rank1", bilist_rank1_RedisCommand, "readonly fast",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"bilist.rank2", bilist_rank2_RedisCommand, "readonly deny-oom fast",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx,"bilist.all", bilist_all_RedisCommand, "write deny-oom",1,1,1) == REDISMODULE_ERR)
+    if (RedisModule_CreateCommand(ctx,"bilist.walk", bilist_walk_RedisCommand, "readonly deny-oom",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
     // if (RedisModule_CreateCommand(ctx,"bilist.add",
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdlib.h>
+
+#include "../redis/src/redismodule.h"
+
+/*
+ * Bloom filter over 64 bit hashes. The probes are derived from the hash
+ * by double hashing, so a key is hashed once however many probes there
+ * are. Entries cannot be removed: the owner rebuilds the filter once
+ * enough of them are gone.
+ */
+struct b_filter {
+    u_int64_t *bits;
+    u_int64_t mask;             // Number of bits - 1, a power of 2
+    u_int32_t probes;
+};
+
+#define B_MIN_BITS 64
+#define B_MAX_PROBES 16
+
+inline static void bloom_init(struct b_filter *filter)
+{
+    filter->bits = NULL;
+    filter->mask = 0;
+    filter->probes = 0;
+}
+
+inline static void bloom_free(struct b_filter *filter)
+{
+    if (filter->bits)
+        RedisModule_Free(filter->bits);
+    bloom_init(filter);
+}
+
+inline static size_t bloom_mem_usage(const struct b_filter *filter)
+{
+    return filter->bits ? (filter->mask + 1) / 8 : 0;
+}
+
+/*
+ * Bits per entry and probes for a false positive rate of at most rate.
+ * Each bit per entry, with the best number of probes, takes the rate down
+ * by a factor of 0.6185.
+ */
+inline static u_int32_t bloom_bits_per_entry(double rate)
+{
+    u_int32_t bits = 1;
+    double fp = 0.6185;
+
+    for (; fp > rate && bits < B_MAX_PROBES * 3 / 2; bits++)
+        fp *= 0.6185;
+    return bits;
+}
+
+inline static u_int32_t bloom_probes(u_int32_t bits_per_entry)
+{
+    u_int32_t probes = (bits_per_entry * 693 + 500) / 1000;    // bits * ln 2
+
+    if (probes < 1)
+        probes = 1;
+    if (probes > B_MAX_PROBES)
+        probes = B_MAX_PROBES;
+    return probes;
+}
+
+/*
+ * An empty filter of at least bits bits, rounded up to a power of 2
+ */
+inline static void bloom_create(struct b_filter *filter, u_int64_t bits, u_int32_t probes)
+{
+    u_int64_t count = B_MIN_BITS;
+
+    while (count < bits)
+        count *= 2;
+    filter->bits = RedisModule_Calloc(count / 64, sizeof(u_int64_t));
+    filter->mask = count - 1;
+    filter->probes = probes;
+}
+
+inline static void bloom_add(struct b_filter *filter, u_int64_t hash)
+{
+    u_int64_t step = (hash >> 32 | hash << 32) | 1;
+    u_int64_t bit;
+    u_int32_t i;
+
+    for (i = 0; i < filter->probes; i++, hash += step) {
+        bit = hash & filter->mask;
+        filter->bits[bit / 64] |= (u_int64_t)1 << (bit % 64);
+    }
+}
+
+/*
+ * 0 if hash was never added, 1 if it may have been
+ */
+inline static int bloom_check(const struct b_filter *filter, u_int64_t hash)
+{
+    u_int64_t step = (hash >> 32 | hash << 32) | 1;
+    u_int64_t bit;
+    u_int32_t i;
+
+    for (i = 0; i < filter->probes; i++, hash += step) {
+        bit = hash & filter->mask;
+        if (!(filter->bits[bit / 64] & ((u_int64_t)1 << (bit % 64))))
+            return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdlib.h>
+
+#include "../redis/src/redismodule.h"
+
+/*
+ * Binary min-heap ordered by time. The h_node is embedded in the element
+ * it orders and remembers its slot, so any element can be removed in
+ * O(log n). Slots are 1-based, index 0 means "not in the heap".
+ */
+struct h_node {
+    long long when;
+    unsigned long index;
+};
+
+struct h_heap {
+    struct h_node **nodes;
+    unsigned long size;
+    unsigned long alloc;
+};
+
+#define H_INITIAL_SIZE 8
+
+inline static void heap_init(struct h_heap *heap)
+{
+    heap->nodes = NULL;
+    heap->size = 0;
+    heap->alloc = 0;
+}
+
+inline static void heap_free(struct h_heap *heap)
+{
+    if (heap->nodes)
+        RedisModule_Free(heap->nodes);
+    heap_init(heap);
+}
+
+inline static size_t heap_mem_usage(const struct h_heap *heap)
+{
+    return heap->alloc * sizeof(struct h_node *);
+}
+
+inline static struct h_node *heap_top(const struct h_heap *heap)
+{
+    return heap->size ? heap->nodes[1] : NULL;
+}
+
+inline static void heap_set(struct h_heap *heap, unsigned long index, struct h_node *node)
+{
+    heap->nodes[index] = node;
+    node->index = index;
+}
+
+inline static void heap_up(struct h_heap *heap, unsigned long index)
+{
+    struct h_node *node = heap->nodes[index];
+
+    while (index > 1 && heap->nodes[index/2]->when > node->when) {
+        heap_set(heap, index, heap->nodes[index/2]);
+        index /= 2;
+    }
+    heap_set(heap, index, node);
+}
+
+inline static void heap_down(struct h_heap *heap, unsigned long index)
+{
+    struct h_node *node = heap->nodes[index];
+    unsigned long child;
+
+    while ((child = index * 2) <= heap->size) {
+        if (child < heap->size && heap->nodes[child+1]->when < heap->nodes[child]->when)
+            child++;
+        if (heap->nodes[child]->when >= node->when)
+            break;
+        heap_set(heap, index, heap->nodes[child]);
+        index = child;
+    }
+    heap_set(heap, index, node);
+}
+
+inline static void heap_push(struct h_heap *heap, struct h_node *node)
+{
+    if (heap->size + 1 >= heap->alloc) {
+        heap->alloc = heap->alloc ? heap->alloc * 2 : H_INITIAL_SIZE;
+        heap->nodes = RedisModule_Realloc(heap->nodes, heap->alloc * sizeof(struct h_node *));
+    }
+    heap->size++;
+    heap_set(heap, heap->size, node);
+    heap_up(heap, heap->size);
+}
+
+inline static void heap_remove(struct h_heap *heap, struct h_node *node)
+{
+    unsigned long index = node->index;
+    struct h_node *last;
+
+    if (index == 0)
+        return;
+    node->index = 0;
+
+    last = heap->nodes[heap->size--];
+    if (last != node) {
+        heap_set(heap, index, last);
+        if (index > 1 && heap->nodes[index/2]->when > last->when)
+            heap_up(heap, index);
+        else
+            heap_down(heap, index);
+    }
+
+    if (heap->alloc > H_INITIAL_SIZE && heap->size < heap->alloc / 4) {
+        heap->alloc /= 2;
+        heap->nodes = RedisModule_Realloc(heap->nodes, heap->alloc * sizeof(struct h_node *));
+    }
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <sys/types.h>
+#include <memory.h>
+#include <stdlib.h>
+
+#include "../redis/src/redismodule.h"
+
+/*
+ * Open addressing hash table for exact lookups. A slot keeps the hash next
+ * to the data, so a probe only looks at the data on a full hash match.
+ * Linear probing with backward shift deletion leaves no tombstones behind.
+ * The table does not know the keys of its data: the caller passes hashes,
+ * and a match function for lookups.
+ */
+struct t_slot {
+    u_int64_t hash;
+    void *data;                 // NULL: empty slot
+};
+
+struct t_table {
+    struct t_slot *slots;
+    u_int64_t mask;             // Number of slots - 1, a power of 2
+    u_int64_t size;
+};
+
+typedef int (*t_match)(const void *data, const void *key);
+
+#define T_INITIAL_SIZE 16
+
+#define T_HASH_MUL 0xc6a4a7935bd1e995ULL
+
+inline static void table_init(struct t_table *table)
+{
+    table->slots = NULL;
+    table->mask = 0;
+    table->size = 0;
+}
+
+inline static void table_free(struct t_table *table)
+{
+    if (table->slots)
+        RedisModule_Free(table->slots);
+    table_init(table);
+}
+
+inline static size_t table_mem_usage(const struct t_table *table)
+{
+    return table->slots ? (table->mask + 1) * sizeof(struct t_slot) : 0;
+}
+
+/*
+ * MurmurHash64A over one more key, chained through h
+ */
+inline static u_int64_t table_hash_bytes(u_int64_t h, const char *ptr, size_t len)
+{
+    u_int64_t k;
+
+    h ^= len * T_HASH_MUL;
+    for (; len >= 8; ptr += 8, len -= 8) {
+        memcpy(&k, ptr, 8);
+        k *= T_HASH_MUL;
+        k ^= k >> 47;
+        k *= T_HASH_MUL;
+        h ^= k;
+        h *= T_HASH_MUL;
+    }
+    if (len) {
+        k = 0;
+        memcpy(&k, ptr, len);
+        h ^= k;
+        h *= T_HASH_MUL;
+    }
+    return h;
+}
+
+inline static u_int64_t table_hash(u_int64_t seed, const char *key1, size_t len1, const char *key2, size_t len2)
+{
+    u_int64_t h;
+
+    h = table_hash_bytes(seed, key1, len1);
+    h = table_hash_bytes(h, key2, len2);
+    h ^= h >> 47;
+    h *= T_HASH_MUL;
+    h ^= h >> 47;
+    return h;
+}
+
+/*
+ * Rehashes into count slots, a power of 2 above the size of the table
+ */
+inline static void table_resize(struct t_table *table, u_int64_t count)
+{
+    struct t_slot *slots;
+    u_int64_t old_count, i, j;
+
+    slots = table->slots;
+    old_count = slots ? table->mask + 1 : 0;
+
+    table->slots = RedisModule_Calloc(count, sizeof(struct t_slot));
+    table->mask = count - 1;
+
+    for (i = 0; i < old_count; i++) {
+        if (slots[i].data == NULL)
+            continue;
+        for (j = slots[i].hash & table->mask; table->slots[j].data; j = (j + 1) & table->mask)
+            ;
+        table->slots[j] = slots[i];
+    }
+    if (slots)
+        RedisModule_Free(slots);
+}
+
+/*
+ * Makes room for size entries without a rehash, and creates the table
+ */
+inline static void table_reserve(struct t_table *table, u_int64_t size)
+{
+    u_int64_t count = table->slots ? table->mask + 1 : T_INITIAL_SIZE;
+
+    // Load factor of at most 3/4
+    while (size * 4 > count * 3)
+        count *= 2;
+    if (table->slots == NULL || count > table->mask + 1)
+        table_resize(table, count);
+}
+
+inline static void *table_find(const struct t_table *table, u_int64_t hash, t_match match, const void *key)
+{
+    u_int64_t i;
+
+    for (i = hash & table->mask; table->slots[i].data; i = (i + 1) & table->mask) {
+        if (table->slots[i].hash == hash && match(table->slots[i].data, key))
+            return table->slots[i].data;
+    }
+    return NULL;
+}
+
+/*
+ * The slot holding data, which must be in the table
+ */
+inline static struct t_slot *table_slot(const struct t_table *table, u_int64_t hash, const void *data)
+{
+    u_int64_t i;
+
+    for (i = hash & table->mask; table->slots[i].data != data; i = (i + 1) & table->mask)
+        ;
+    return &(table->slots[i]);
+}
+
+/*
+ * Adds data, whose key must not be in the table yet
+ */
+inline static void table_insert(struct t_table *table, u_int64_t hash, void *data)
+{
+    u_int64_t i;
+
+    table_reserve(table, table->size + 1);
+    for (i = hash & table->mask; table->slots[i].data; i = (i + 1) & table->mask)
+        ;
+    table->slots[i].hash = hash;
+    table->slots[i].data = data;
+    table->size++;
+}
+
+/*
+ * Points the entry of data at a replacement with the same key
+ */
+inline static void table_replace(struct t_table *table, u_int64_t hash, const void *data, void *replacement)
+{
+    table_slot(table, hash, data)->data = replacement;
+}
+
+/*
+ * Removes data, which must be in the table. The entries after it move back
+ * to fill the gap, unless that would take them before their home slot.
+ */
+inline static void table_delete(struct t_table *table, u_int64_t hash, const void *data)
+{
+    u_int64_t i, j, home;
+
+    i = table_slot(table, hash, data) - table->slots;
+    for (j = (i + 1) & table->mask; table->slots[j].data; j = (j + 1) & table->mask) {
+        home = table->slots[j].hash & table->mask;
+        if (((j - home) & table->mask) >= ((j - i) & table->mask)) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+    table->slots[i].data = NULL;
+    table->size--;
+
+    if (table->mask + 1 > T_INITIAL_SIZE && table->size * 8 < table->mask + 1)
+        table_resize(table, (table->mask + 1) / 2);
+}
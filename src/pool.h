@@ -0,0 +1,369 @@
+#pragma once
+
+#include <sys/types.h>
+#include <memory.h>
+#include <stdlib.h>
+
+#include "../redis/src/redismodule.h"
+
+/*
+ * Slab allocator for the small objects of one bilist. Chunks are rounded
+ * up to a multiple of P_CLASS_SIZE, carved from slabs that double in size
+ * up to P_SLAB_MAX, and recycled through one free list per size class.
+ * Larger chunks come from the module allocator but are still tracked, so
+ * the whole pool is released by walking its slabs, not its objects.
+ * The caller passes the size of a chunk back when freeing it.
+ *
+ * To defragment, pool_evacuate retires all slabs at once: new chunks come
+ * from fresh slabs, the owner moves its objects with pool_defrag, and the
+ * retired slabs are freed when their last chunk is gone.
+ */
+#define P_CLASS_SIZE 16
+#define P_CLASSES 32            // Chunks up to 512 bytes come from slabs
+#define P_SLAB_MIN 256
+#define P_SLAB_MAX 65536
+#define P_IDLE_MIN 256          // Less idle memory is not worth a defrag pass
+
+#define P_CLASS(S) (((S) + P_CLASS_SIZE - 1) / P_CLASS_SIZE)
+
+struct p_slab {
+    struct p_slab *next;
+    size_t size;
+    char data[];
+};
+
+struct p_large {
+    struct p_large *next;
+    struct p_large *prev;
+    size_t size;
+    size_t pad;                 // Keeps the chunk 16 byte aligned
+    char data[];
+};
+
+struct p_free {
+    struct p_free *next;
+};
+
+struct pool {
+    struct p_slab *slabs;
+    char *top;                  // Unused part of the newest slab
+    char *end;
+    struct p_free *free[P_CLASSES + 1];
+    struct p_large *large;
+    size_t allocated;           // Bytes taken from the module allocator
+    size_t used;                // Bytes handed out
+    size_t blocks;              // Slabs and large chunks, the cost of a release
+
+    struct p_slab *evacuated;   // Retired slabs, emptied by pool_defrag
+    struct p_slab **index;      // The same sorted by address
+    size_t index_size;
+    size_t evacuated_used;      // Bytes still in use in them
+};
+
+inline static void pool_init(struct pool *pool)
+{
+    int i;
+
+    pool->slabs = NULL;
+    pool->top = NULL;
+    pool->end = NULL;
+    for (i = 0; i <= P_CLASSES; i++)
+        pool->free[i] = NULL;
+    pool->large = NULL;
+    pool->allocated = 0;
+    pool->used = 0;
+    pool->blocks = 0;
+    pool->evacuated = NULL;
+    pool->index = NULL;
+    pool->index_size = 0;
+    pool->evacuated_used = 0;
+}
+
+inline static void pool_free_slabs(struct pool *pool, struct p_slab *slab)
+{
+    struct p_slab *next;
+
+    for (; slab; slab = next) {
+        next = slab->next;
+        pool->allocated -= sizeof(struct p_slab) + slab->size;
+        pool->blocks--;
+        RedisModule_Free(slab);
+    }
+}
+
+inline static void pool_drop_evacuated(struct pool *pool)
+{
+    pool_free_slabs(pool, pool->evacuated);
+    RedisModule_Free(pool->index);
+    pool->evacuated = NULL;
+    pool->index = NULL;
+    pool->index_size = 0;
+    pool->evacuated_used = 0;
+}
+
+inline static void pool_release(struct pool *pool)
+{
+    struct p_large *large;
+
+    pool_free_slabs(pool, pool->slabs);
+    if (pool->evacuated)
+        pool_drop_evacuated(pool);
+    while ((large = pool->large)) {
+        pool->large = large->next;
+        RedisModule_Free(large);
+    }
+    pool_init(pool);
+}
+
+inline static size_t pool_mem_usage(const struct pool *pool)
+{
+    return pool->allocated;
+}
+
+inline static size_t pool_blocks(const struct pool *pool)
+{
+    return pool->blocks;
+}
+
+inline static int pool_evacuating(const struct pool *pool)
+{
+    return pool->evacuated != NULL;
+}
+
+/*
+ * Whether ptr is a chunk of an evacuated slab
+ */
+inline static int pool_evacuated(const struct pool *pool, const void *ptr)
+{
+    size_t lo = 0, hi = pool->index_size, mid;
+
+    // Last slab starting at or before ptr
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if ((const char *)pool->index[mid]->data <= (const char *)ptr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo > 0 && (const char *)ptr < pool->index[lo-1]->data + pool->index[lo-1]->size;
+}
+
+/*
+ * Memory of the pool neither handed out nor left at the top of the newest
+ * slab: freed chunks waiting for reuse, and headers.
+ */
+inline static int pool_fragmented(const struct pool *pool)
+{
+    size_t idle = pool->allocated - pool->used - (pool->end - pool->top);
+
+    return idle >= P_IDLE_MIN && idle > pool->used / 4;
+}
+
+/*
+ * The rest of the newest slab goes to the free list of the largest class
+ * it can hold, so nothing is lost when a new slab is started.
+ */
+inline static void pool_retire_top(struct pool *pool)
+{
+    size_t cls;
+    struct p_free *chunk;
+
+    cls = (pool->end - pool->top) / P_CLASS_SIZE;
+    if (cls) {
+        chunk = (struct p_free *)pool->top;
+        chunk->next = pool->free[cls];
+        pool->free[cls] = chunk;
+    }
+    pool->top = pool->end;
+}
+
+inline static void pool_grow(struct pool *pool, size_t size)
+{
+    struct p_slab *slab;
+    size_t slab_size;
+
+    slab_size = pool->slabs ? pool->slabs->size * 2 : P_SLAB_MIN;
+    if (slab_size > P_SLAB_MAX)
+        slab_size = P_SLAB_MAX;
+    if (slab_size < size)
+        slab_size = size;
+
+    pool_retire_top(pool);
+
+    slab = RedisModule_Alloc(sizeof(struct p_slab) + slab_size);
+    slab->size = slab_size;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->allocated += sizeof(struct p_slab) + slab_size;
+    pool->blocks++;
+
+    pool->top = slab->data;
+    pool->end = slab->data + slab_size;
+}
+
+inline static void *pool_alloc(struct pool *pool, size_t size)
+{
+    struct p_large *large;
+    struct p_free *chunk;
+    size_t cls;
+
+    cls = P_CLASS(size);
+    if (cls == 0)
+        cls = 1;
+
+    if (cls > P_CLASSES) {
+        large = RedisModule_Alloc(sizeof(struct p_large) + size);
+        large->size = size;
+        large->prev = NULL;
+        large->next = pool->large;
+        if (pool->large)
+            pool->large->prev = large;
+        pool->large = large;
+        pool->allocated += sizeof(struct p_large) + size;
+        pool->used += size;
+        pool->blocks++;
+        return large->data;
+    }
+
+    pool->used += cls * P_CLASS_SIZE;
+
+    if ((chunk = pool->free[cls])) {
+        pool->free[cls] = chunk->next;
+        return chunk;
+    }
+
+    if ((size_t)(pool->end - pool->top) < cls * P_CLASS_SIZE)
+        pool_grow(pool, cls * P_CLASS_SIZE);
+
+    chunk = (struct p_free *)pool->top;
+    pool->top += cls * P_CLASS_SIZE;
+    return chunk;
+}
+
+inline static void pool_free(struct pool *pool, void *ptr, size_t size)
+{
+    struct p_large *large;
+    struct p_free *chunk;
+    size_t cls;
+
+    cls = P_CLASS(size);
+    if (cls == 0)
+        cls = 1;
+
+    if (cls > P_CLASSES) {
+        large = (struct p_large *)((char *)ptr - sizeof(struct p_large));
+        if (large->prev)
+            large->prev->next = large->next;
+        else
+            pool->large = large->next;
+        if (large->next)
+            large->next->prev = large->prev;
+        pool->allocated -= sizeof(struct p_large) + large->size;
+        pool->used -= size;
+        pool->blocks--;
+        RedisModule_Free(large);
+    } else if (pool->evacuated && pool_evacuated(pool, ptr)) {
+        // Not reused, the slab goes away with its last chunk
+        pool->used -= cls * P_CLASS_SIZE;
+        pool->evacuated_used -= cls * P_CLASS_SIZE;
+        if (pool->evacuated_used == 0)
+            pool_drop_evacuated(pool);
+    } else {
+        chunk = ptr;
+        chunk->next = pool->free[cls];
+        pool->free[cls] = chunk;
+        pool->used -= cls * P_CLASS_SIZE;
+    }
+
+    // Nothing left in use: hand the slabs back instead of keeping them
+    if (pool->used == 0)
+        pool_release(pool);
+}
+
+/*
+ * Whether a chunk allocated for old bytes can hold size bytes instead and
+ * then be freed with that size
+ */
+inline static int pool_fits(size_t old, size_t size)
+{
+    if (P_CLASS(old) > P_CLASSES)
+        return size == old;
+    return P_CLASS(size) == P_CLASS(old);
+}
+
+inline static int pool_slab_cmp(const void *a, const void *b)
+{
+    const struct p_slab *slab_a = *(struct p_slab * const *)a;
+    const struct p_slab *slab_b = *(struct p_slab * const *)b;
+
+    return slab_a < slab_b ? -1 : slab_a > slab_b;
+}
+
+/*
+ * Retires every slab: they stop serving allocations and are freed once
+ * pool_defrag, or pool_free, has taken the last chunk out of them.
+ */
+inline static void pool_evacuate(struct pool *pool)
+{
+    struct p_slab *slab;
+    struct p_large *large;
+    size_t count = 0;
+    int i;
+
+    if (pool->evacuated || pool->slabs == NULL)
+        return;
+
+    for (slab = pool->slabs; slab; slab = slab->next)
+        count++;
+    pool->index = RedisModule_Alloc(count * sizeof(struct p_slab *));
+    for (slab = pool->slabs; slab; slab = slab->next)
+        pool->index[pool->index_size++] = slab;
+    qsort(pool->index, count, sizeof(struct p_slab *), pool_slab_cmp);
+
+    pool->evacuated_used = pool->used;
+    for (large = pool->large; large; large = large->next)
+        pool->evacuated_used -= large->size;
+
+    pool->evacuated = pool->slabs;
+    pool->slabs = NULL;
+    pool->top = NULL;
+    pool->end = NULL;
+    for (i = 0; i <= P_CLASSES; i++)
+        pool->free[i] = NULL;
+
+    if (pool->evacuated_used == 0)
+        pool_drop_evacuated(pool);
+}
+
+/*
+ * Moves a chunk out of an evacuated slab, and a large chunk wherever the
+ * allocator sees fit. Returns the new address, NULL if the chunk stays:
+ * the caller points the references to the chunk at the new address, the
+ * old one is no longer valid.
+ */
+inline static void *pool_defrag(RedisModuleDefragCtx *ctx, struct pool *pool, void *ptr, size_t size)
+{
+    struct p_large *large;
+    void *moved;
+
+    if (P_CLASS(size) > P_CLASSES) {
+        large = RedisModule_DefragAlloc(ctx, (char *)ptr - sizeof(struct p_large));
+        if (large == NULL)
+            return NULL;
+        if (large->prev)
+            large->prev->next = large;
+        else
+            pool->large = large;
+        if (large->next)
+            large->next->prev = large;
+        return large->data;
+    }
+
+    if (pool->evacuated == NULL || !pool_evacuated(pool, ptr))
+        return NULL;
+
+    moved = pool_alloc(pool, size);
+    memcpy(moved, ptr, size);
+    pool_free(pool, ptr, size);
+    return moved;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <sys/types.h>
+#include <memory.h>
+#include <stdlib.h>
+
+#include "../redis/src/redismodule.h"
+
+#include "skiplist.h"
+
+/*
+ * Sorted array of keys, the compact encoding of an index. Lookups are
+ * binary searches and updates move the tail of the array, which beats
+ * skip list nodes on memory and locality as long as the array is small.
+ */
+struct s_entry {
+    struct s_key key;
+    void *data;
+};
+
+struct s_array {
+    struct s_entry *entries;
+    u_int32_t size;
+    u_int32_t alloc;
+};
+
+#define A_INITIAL_SIZE 4
+
+inline static void sarray_init(struct s_array *array)
+{
+    array->entries = NULL;
+    array->size = 0;
+    array->alloc = 0;
+}
+
+inline static void sarray_free(struct s_array *array)
+{
+    if (array->entries)
+        FREE(array->entries);
+    sarray_init(array);
+}
+
+inline static size_t sarray_mem_usage(const struct s_array *array)
+{
+    return array->alloc * sizeof(struct s_entry);
+}
+
+/*
+ * Number of entries less than key, which is also the index of the first
+ * entry not less than key.
+ */
+inline static u_int32_t sarray_count_less(const struct s_array *array, const struct s_key *key)
+{
+    u_int32_t lo = 0, hi = array->size, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (keycmp(&(array->entries[mid].key), key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Number of entries not greater than key
+ */
+inline static u_int32_t sarray_count_not_greater(const struct s_array *array, const struct s_key *key)
+{
+    u_int32_t lo = 0, hi = array->size, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (keycmp(&(array->entries[mid].key), key) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+inline static struct s_entry * sarray_find(const struct s_array *array, const struct s_key *key)
+{
+    u_int32_t index;
+
+    index = sarray_count_less(array, key);
+    if (index < array->size && keycmp(&(array->entries[index].key), key) == 0)
+        return &(array->entries[index]);
+    return NULL;
+}
+
+/*
+ * The keys are not copied, as in slist_insert.
+ */
+inline static void sarray_insert_at(struct s_array *array, u_int32_t index, const struct s_key *key, void *data)
+{
+    if (array->size == array->alloc) {
+        array->alloc = array->alloc ? array->alloc * 2 : A_INITIAL_SIZE;
+        array->entries = REALLOC(array->entries, array->alloc * sizeof(struct s_entry));
+    }
+    memmove(array->entries + index + 1, array->entries + index, (array->size - index) * sizeof(struct s_entry));
+    array->entries[index].key = *key;
+    array->entries[index].data = data;
+    array->size++;
+}
+
+/*
+ * Removes the entries from index from up to, not including, index to.
+ */
+inline static void sarray_remove_range(struct s_array *array, u_int32_t from, u_int32_t to)
+{
+    memmove(array->entries + from, array->entries + to, (array->size - to) * sizeof(struct s_entry));
+    array->size -= to - from;
+
+    if (array->alloc > A_INITIAL_SIZE && array->size < array->alloc / 4) {
+        array->alloc /= 2;
+        array->entries = REALLOC(array->entries, array->alloc * sizeof(struct s_entry));
+    }
+}
+
+inline static void * sarray_delete(struct s_array *array, const struct s_key *key)
+{
+    struct s_entry *entry;
+    void *result;
+
+    entry = sarray_find(array, key);
+    if (entry == NULL)
+        return NULL;
+
+    result = entry->data;
+    sarray_remove_range(array, entry - array->entries, entry - array->entries + 1);
+    return result;
+}
@@ -7,6 +7,7 @@
 #include "../redis/src/redismodule.h"
 
 #include "prand.h"
+#include "pool.h"
 
 #define MALLOC(S) RedisModule_Alloc(S)
 #define CALLOC(N,S) RedisModule_Calloc(N, S) 
@@ -42,46 +43,115 @@
 //     void *data;
 // };
 
+/*
+ * Keys are binary safe and length prefixed. The first 8 bytes of the
+ * primary key are cached big endian in prefix, so most comparisons are
+ * settled by one integer compare without touching the key memory.
+ * A NULL secondary key matches any secondary key.
+ */
+struct s_key {
+    u_int64_t prefix;
+    const char *primary_key;
+    const char *secondary_key;
+    u_int32_t primary_len;
+    u_int32_t secondary_len;
+};
+
+/*
+ * Every forward link carries its span, the number of level 0 steps it
+ * covers, as in the Redis zset skip list. Summing spans along a search
+ * gives the rank of a node in O(log n). A NULL link spans to the end of
+ * the list.
+ */
+struct s_level {
+    struct s_node *next;
+    unsigned long span;
+};
+
+/*
+ * Nodes are allocated with only as many forward links as their level,
+ * the head node is always S_HEIGHT levels high. The backward link is
+ * kept for level 0 only, NULL for the first node of the list.
+ */
 struct s_node {
-    const char * primary_key;
-    const char * secondary_key;
-    struct s_node *next_n[S_HEIGHT];
-    struct s_node *prev_n[S_HEIGHT];
+    struct s_key key;
     void *data;
+    struct s_node *prev_n;
+    int height;
+    struct s_level level[];
 };
 
 struct s_list {
-    struct s_node *first_n[S_HEIGHT];
+    struct s_node *head;
+    int level;              // Highest level in use, searches start there
     u_int64_t elements;
+    u_int64_t links;        // Forward links allocated in the nodes, head excluded
 
     struct prand pseed;
+
+    struct pool *pool;      // Nodes come from here if not NULL
+};
+
+/*
+ * Result of a search: node[i] is the last node before the key at level i,
+ * rank[i] its position in the list (the head is 0, the first node 1).
+ */
+struct s_path {
+    struct s_node *node[S_HEIGHT];
+    unsigned long rank[S_HEIGHT];
 };
 
+#define S_NODE_SIZE(H) (sizeof(struct s_node) + (H) * sizeof(struct s_level))
+
 // struct s_list *slist_create(int reverse, size_t *size);
 // struct s_data * slist_find(struct s_list *list, const char *firstkey, const char *secondkey);
-// struct s_node *slist_find_first(struct s_list *list, const char *key);
 // struct s_data * slist_insert(struct s_list *list, struct s_data *data);
 // struct s_data * slist_delete(struct s_list *list, const char *key1, const char *key2);
 // void slist_free(struct s_list *list, void (*freenode)(struct s_data *data));
 
-inline static struct s_list *slist_create()
+inline static struct s_node *slist_node_alloc(struct s_list *list, int height)
 {
-    int i;
+    if (list->pool)
+        return (struct s_node *)pool_alloc(list->pool, S_NODE_SIZE(height));
+    return (struct s_node *)MALLOC(S_NODE_SIZE(height));
+}
 
+inline static void slist_node_free(struct s_list *list, struct s_node *node)
+{
+    if (list->pool)
+        pool_free(list->pool, node, S_NODE_SIZE(node->height));
+    else
+        FREE(node);
+}
+
+/*
+ * pool may be NULL, then every node is allocated on its own
+ */
+inline static struct s_list *slist_create(struct pool *pool)
+{
     struct s_list *result = (struct s_list *)MALLOC(sizeof(struct s_list));
-    struct s_node *first_node = (struct s_node *)MALLOC(sizeof(struct s_node));
+    struct s_node *head;
+
     memset(result, 0, sizeof(struct s_list));
-    memset(first_node, 0, sizeof(struct s_node));
+    result->pool = pool;
 
-    for (i=0; i < S_HEIGHT; i++) {
-        result->first_n[i] = first_node;
-    }
+    head = slist_node_alloc(result, S_HEIGHT);
+    memset(head, 0, S_NODE_SIZE(S_HEIGHT));
+
+    head->height = S_HEIGHT;
+    result->head = head;
+    result->level = 1;
 
     pseed(&(result->pseed), time(NULL));
 
     return result;
 }
 
+inline static size_t slist_mem_usage(const struct s_list *list)
+{
+    return sizeof(struct s_list) + S_NODE_SIZE(S_HEIGHT) + list->elements * sizeof(struct s_node) + list->links * sizeof(struct s_level);
+}
+
 // inline static struct s_data *slist_datanode_create(void *data, const char *key1, const char *key2, long value)
 // {
 //     struct s_data *result = MALLOC(sizeof(struct s_data));
@@ -95,137 +165,313 @@ inline static struct s_list *slist_create()
 //     return result;
 // }
 
-inline static int keycmp(const char *key1, const char *key2, const char *compare1, const char *compare2)
+inline static u_int64_t slist_prefix(const char *key, size_t len)
 {
-    unsigned char *ptr, *ptr2;
-    int phase = 0;
+    u_int64_t prefix = 0;
+    size_t i;
 
-    if (key1 == NULL)
-        return -1;
-    if (compare1 == NULL)
-        return 1;
-    
-    ptr = (unsigned char *)key1;
-    ptr2 = (unsigned char *)compare1;
+    for (i = 0; i < sizeof(prefix); i++) {
+        prefix <<= 8;
+        if (i < len)
+            prefix |= (unsigned char)key[i];
+    }
+    return prefix;
+}
+
+inline static void slist_key(struct s_key *key, const char *key1, size_t len1, const char *key2, size_t len2)
+{
+    key->prefix = slist_prefix(key1, len1);
+    key->primary_key = key1;
+    key->primary_len = len1;
+    key->secondary_key = key2;
+    key->secondary_len = len2;
+}
+
+inline static int bytecmp(const char *ptr1, size_t len1, const char *ptr2, size_t len2, size_t skip)
+{
+    size_t len = len1 < len2 ? len1 : len2;
+    int cmp;
+
+    if (len > skip) {
+        cmp = memcmp(ptr1 + skip, ptr2 + skip, len - skip);
+        if (cmp)
+            return cmp;
+    }
+    if (len1 == len2)
+        return 0;
+    return len1 < len2 ? -1 : 1;
+}
+
+inline static int keycmp(const struct s_key *key, const struct s_key *compare)
+{
+    int cmp;
 
-    for (;;) {
-        if (*ptr != *ptr2) {
-            return *ptr - *ptr2;
+    if (key->prefix != compare->prefix)
+        return key->prefix < compare->prefix ? -1 : 1;
+
+    // Equal prefixes: the first (up to) 8 bytes are known to be the same
+    cmp = bytecmp(key->primary_key, key->primary_len, compare->primary_key, compare->primary_len, sizeof(key->prefix));
+    if (cmp || key->secondary_key == NULL || compare->secondary_key == NULL)
+        return cmp;
+
+    return bytecmp(key->secondary_key, key->secondary_len, compare->secondary_key, compare->secondary_len, 0);
+}
+
+inline static struct s_node * slist_path(struct s_list *list, const struct s_key *key, struct s_path *path)
+{
+    int i;
+    unsigned long rank;
+
+    struct s_node *node;
+    struct s_node *next;
+
+    node = list->head;
+    rank = 0;
+
+    for (i=list->level-1; i >= 0; --i) {
+        for (next = node->level[i].next; next && keycmp(&next->key, key) < 0; next = node->level[i].next) {
+            rank += node->level[i].span;
+            node = next;
         }
-        if (*ptr == '\0' && phase == 0) {
-            if (key2 == NULL || compare2 == NULL)
-                return 0;
-            ptr = (unsigned char *)key2;
-            ptr2 = (unsigned char *)compare2;
-            phase = 1;
-        } else if (*ptr == '\0' && phase == 1) {
-            return 0;
+        path->node[i] = node;
+        path->rank[i] = rank;
+    }
+
+    node = node->level[0].next;
+    if (node && keycmp(&node->key, key) == 0)
+        return node;
+    return NULL;
+}
+
+/*
+ * Finger search: path holds the result of a search for a key not greater
+ * than key, in the same list. Climbs only as high as needed to get past
+ * the old position, so a run of ascending keys costs O(log distance)
+ * per key instead of a descent from the head each time.
+ */
+inline static struct s_node * slist_path_next(struct s_list *list, const struct s_key *key, struct s_path *path)
+{
+    int i;
+    int level;
+    unsigned long rank;
+
+    struct s_node *node;
+    struct s_node *next;
+
+    for (level = 0; level < list->level-1; level++) {
+        next = path->node[level]->level[level].next;
+        if (next == NULL || keycmp(&next->key, key) >= 0)
+            break;
+    }
+
+    node = path->node[level];
+    rank = path->rank[level];
+
+    for (i=level; i >= 0; --i) {
+        for (next = node->level[i].next; next && keycmp(&next->key, key) < 0; next = node->level[i].next) {
+            rank += node->level[i].span;
+            node = next;
         }
-        ptr++;
-        ptr2++;
+        path->node[i] = node;
+        path->rank[i] = rank;
     }
-    return 0;
+
+    node = node->level[0].next;
+    if (node && keycmp(&node->key, key) == 0)
+        return node;
+    return NULL;
 }
 
-inline static struct s_node * slist_path(struct s_list *list, const char *key1, const char *key2, struct s_node **path)
+inline static struct s_node * slist_find(struct s_list *list, const struct s_key *key)
 {
-    int height = S_HEIGHT;
 
+    struct s_node *node;
+
+    struct s_path path;
+
+    node = slist_path(list, key, &path);
+
+    return node;
+}
+
+/*
+ * Like slist_path, but path->node[i] is the last node not greater than
+ * key at level i. Returns path->node[0], NULL if it is the head.
+ */
+inline static struct s_node * slist_path_floor(struct s_list *list, const struct s_key *key, struct s_path *path)
+{
     int i;
+    unsigned long rank;
 
     struct s_node *node;
+    struct s_node *next;
 
-    node = list->first_n[0];
-
-    for (i=height-1; i >= 0; --i) {
-        path[i] = node;
-        node = node->next_n[i];
-        while (node) {
-            int cmp = keycmp(node->primary_key, node->secondary_key, key1, key2);
-            if (cmp == 0)
-                return node;
-            if (cmp > 0) {
-                node = node->prev_n[i];
-                break;
-            }
-            path[i] = node;
-            node = node->next_n[i];
+    node = list->head;
+    rank = 0;
+
+    for (i=list->level-1; i >= 0; --i) {
+        for (next = node->level[i].next; next && keycmp(&next->key, key) <= 0; next = node->level[i].next) {
+            rank += node->level[i].span;
+            node = next;
         }
-        node = path[i];
+        path->node[i] = node;
+        path->rank[i] = rank;
+    }
+
+    return node == list->head ? NULL : node;
+}
+
+/*
+ * Node at position rank, counting from 1. NULL if rank is out of range.
+ */
+inline static struct s_node * slist_at(struct s_list *list, unsigned long rank)
+{
+    int i;
+    unsigned long traversed;
+
+    struct s_node *node;
+
+    if (rank == 0 || rank > list->elements)
+        return NULL;
+
+    node = list->head;
+    traversed = 0;
+
+    for (i=list->level-1; i >= 0; --i) {
+        while (node->level[i].next && traversed + node->level[i].span <= rank) {
+            traversed += node->level[i].span;
+            node = node->level[i].next;
+        }
+        if (traversed == rank)
+            return node;
     }
     return NULL;
 }
 
-inline static struct s_node * slist_find(struct s_list *list, const char *firstkey, const char *secondkey)
+/*
+ * Geometric level distribution (p = 1/2) from a single random draw:
+ * every trailing 1 bit adds a level.
+ */
+inline static int slist_random_height(struct s_list *list)
 {
+    u_int64_t bits = prand(&(list->pseed));
+    int height = 1;
 
+    while (height < S_HEIGHT && (bits & 1)) {
+        bits >>= 1;
+        height++;
+    }
+    return height;
+}
+
+/*
+ * Links a new node after path->node[0], path being the result of a search
+ * for key that found nothing. The path stays usable for slist_path_next.
+ * The keys are not copied: they must stay valid for as long as the node is
+ * in the list, typically by pointing into datanode.
+ */
+inline static struct s_node * slist_link(struct s_list *list, struct s_path *path, const struct s_key *key, void *datanode)
+{
     struct s_node *node;
+    struct s_node *prev;
 
-    struct s_node *path[S_HEIGHT];
+    int i;
+    int height;
 
-    node = slist_path(list, firstkey, secondkey, path);
+    height = slist_random_height(list);
+    if (height > list->level) {
+        for (i = list->level; i < height; i++) {
+            path->node[i] = list->head;
+            path->rank[i] = 0;
+            list->head->level[i].span = list->elements;
+        }
+        list->level = height;
+    }
 
+    node = slist_node_alloc(list, height);
+    node->key = *key;
+    node->data = datanode;
+    node->height = height;
+    node->prev_n = (path->node[0] == list->head) ? NULL : path->node[0];
+
+    for (i = 0; i < height; i++) {
+        prev = path->node[i];
+        node->level[i].next = prev->level[i].next;
+        node->level[i].span = prev->level[i].span - (path->rank[0] - path->rank[i]);
+        prev->level[i].next = node;
+        prev->level[i].span = path->rank[0] - path->rank[i] + 1;
+    }
+    for (; i < list->level; i++)
+        path->node[i]->level[i].span++;
+
+    if (node->level[0].next)
+        node->level[0].next->prev_n = node;
+
+    list->elements++;
+    list->links += height;
     return node;
 }
 
-inline static void * slist_find_first(struct s_list *list, const char *key)
+/*
+ * Path to the end of the list: node[i] is the last node of level i
+ */
+inline static void slist_path_tail(struct s_list *list, struct s_path *path)
 {
+    int i;
+    unsigned long rank;
     struct s_node *node;
-    struct s_node *prev;
 
-    struct s_node *path[S_HEIGHT];
+    node = list->head;
+    rank = 0;
 
-    const char *key1 = key;
-    const char *key2 = NULL;
+    for (i=list->level-1; i >= 0; --i) {
+        while (node->level[i].next) {
+            rank += node->level[i].span;
+            node = node->level[i].next;
+        }
+        path->node[i] = node;
+        path->rank[i] = rank;
+    }
+}
 
-    node = slist_path(list, key1, key2, path);
+/*
+ * Links a node after the last one, so the keys must come in ascending
+ * order. path comes from slist_path_tail and is kept at the end of the
+ * list, which builds a list bottom-up in O(n) without any search.
+ */
+inline static struct s_node * slist_append(struct s_list *list, struct s_path *path, const struct s_key *key, void *datanode)
+{
+    struct s_node *node;
+    int i;
 
-    if (node == NULL)
-        return NULL;
-    
-    // We need a faster algorithm - JT
-    for (prev = node->prev_n[0]; keycmp(prev->primary_key, NULL, key, NULL) == 0; node = prev, prev = node->prev_n[0]);
+    node = slist_link(list, path, key, datanode);
+    for (i = 0; i < node->height; i++) {
+        path->node[i] = node;
+        path->rank[i] = list->elements;
+    }
     return node;
 }
 
-inline static void * slist_insert(struct s_list *list, const char *key1, const char *key2, void *datanode)
+inline static void * slist_insert(struct s_list *list, const struct s_key *key, void *datanode)
 {
 
     struct s_node *node;
-    struct s_node *path[S_HEIGHT];
+    struct s_path path;
     void *olddata;
 
-    int i;
-    unsigned int rtest;
-
-    node = slist_path(list, key1, key2, path);
+    node = slist_path(list, key, &path);
 
     if (node) {
         olddata = node->data;
+        node->key = *key;
         node->data = datanode;
         return olddata;
     }
 
-    node = (struct s_node *)MALLOC(sizeof(struct s_node));
-    memset(node, 0, sizeof(struct s_node));
-    node->primary_key = STRDUP(key1);
-    node->secondary_key = STRDUP(key2);
-    node->data = datanode;
-    
-    for (i = 0; i < S_HEIGHT; i++) {
-        rtest = prand(&(list->pseed)) % 2; 
-        if (i > 0 && !rtest)
-            return NULL; // NULL => Did not replace old data
-        node->prev_n[i] = path[i];
-        node->next_n[i] = path[i]->next_n[i];
-        if (node->next_n[i])
-            node->next_n[i]->prev_n[0] = node;
-        path[i]->next_n[i] = node;
-    }
-    return NULL;
+    slist_link(list, &path, key, datanode);
+    return NULL; // NULL => Did not replace old data
 }
 
-
 // inline static struct s_data * slist_delete(struct s_list *list, const char *key1, const char *key2)
 // {
 //     int i;
@@ -281,46 +527,113 @@ inline static void * slist_insert(struct s_list *list, const char *key1, const c
 //     return NULL; // Not found
 // }
 
+/*
+ * Points the links to a node at moved, a copy of it at a new address.
+ * path is the result of the search that found the node.
+ */
+inline static void slist_relink(struct s_path *path, struct s_node *moved)
+{
+    int i;
+
+    for (i = 0; i < moved->height; i++)
+        path->node[i]->level[i].next = moved;
+    if (moved->level[0].next)
+        moved->level[0].next->prev_n = moved;
+}
+
+/*
+ * Nodes taken from a pool are left to the owner of the pool, which
+ * releases them all at once.
+ */
 inline static void slist_free(struct s_list *list)
 {
     struct s_node *node;
     struct s_node *tmp;
 
-    for (node = list->first_n[0]; node;) {
+    for (node = list->pool ? NULL : list->head; node;) {
         tmp = node;
-        node = node->next_n[0];
+        node = node->level[0].next;
         FREE(tmp);
     }
     FREE(list);
 }
 
-inline static void * slist_delete(struct s_list *list, const char *key1, const char *key2)
+/*
+ * Unlinks and frees node, path being the result of the search that found
+ * it. The path stays usable for slist_path_next.
+ */
+inline static void slist_unlink(struct s_list *list, struct s_path *path, struct s_node *node)
 {
     int i;
-    int height;
+
+    for (i=0; i<node->height; i++) {
+        path->node[i]->level[i].next = node->level[i].next;
+        path->node[i]->level[i].span += node->level[i].span - 1;
+    }
+    for (; i<list->level; i++) {
+        path->node[i]->level[i].span--;
+    }
+    if (node->level[0].next) {
+        node->level[0].next->prev_n = node->prev_n;
+    }
+    while (list->level > 1 && list->head->level[list->level-1].next == NULL)
+        list->level--;
+    list->elements--;
+    list->links -= node->height;
+    slist_node_free(list, node);
+}
+
+/*
+ * Unlinks and frees the nodes between two searches in one splice: the
+ * nodes after from->node[0] up to and including to->node[0]. from is
+ * typically a slist_path and to a slist_path_floor result.
+ */
+inline static void slist_unlink_range(struct s_list *list, struct s_path *from, struct s_path *to)
+{
+    int i;
+    unsigned long removed;
+
     struct s_node *node;
-    void *result;
+    struct s_node *next;
 
-    struct s_node *path[S_HEIGHT];
+    removed = to->rank[0] - from->rank[0];
+    if (removed == 0)
+        return;
 
-    memset(path,0,sizeof(path));
+    node = from->node[0]->level[0].next;
 
+    for (i=0; i<list->level; i++) {
+        from->node[i]->level[i].span = to->rank[i] + to->node[i]->level[i].span - from->rank[i] - removed;
+        from->node[i]->level[i].next = to->node[i]->level[i].next;
+    }
+    if (to->node[0]->level[0].next) {
+        to->node[0]->level[0].next->prev_n = (from->node[0] == list->head) ? NULL : from->node[0];
+    }
+    while (list->level > 1 && list->head->level[list->level-1].next == NULL)
+        list->level--;
+
+    list->elements -= removed;
+    for (; removed; removed--) {
+        next = node->level[0].next;
+        list->links -= node->height;
+        slist_node_free(list, node);
+        node = next;
+    }
+}
+
+inline static void * slist_delete(struct s_list *list, const struct s_key *key)
+{
+    struct s_node *node;
+    void *result;
 
-    height = S_HEIGHT;
+    struct s_path path;
 
-    node = slist_path(list, key1, key2, path);
+    node = slist_path(list, key, &path);
     result = NULL;
 
     if (node) {
         result = node->data;
-        for (i=0; i<height; i++) {
-            if (node->prev_n[i])
-                node->prev_n[i]->next_n[i] = node->next_n[i];
-            if (node->next_n[i]) {
-                node->next_n[i]->prev_n[i] = node->prev_n[i];
-            }
-        }
-        FREE(node);
+        slist_unlink(list, &path, node);
     }
     return result;
 }
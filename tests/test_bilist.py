@@ -0,0 +1,411 @@
+#!/usr/bin/env python3
+"""
+Tests against a redis-server with the module loaded. The server is started
+on a free port for each test class:
+
+    REDIS_SERVER=/path/to/redis-server python3 tests/test_bilist.py
+
+BILIST_MODULE overrides the module path (default src/bilist.so).
+"""
+import os
+import shutil
+import socket
+import subprocess
+import tempfile
+import time
+import unittest
+
+import redis
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SERVER = os.environ.get('REDIS_SERVER', 'redis-server')
+MODULE = os.environ.get('BILIST_MODULE', os.path.join(ROOT, 'src', 'bilist.so'))
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+class ServerTestCase(unittest.TestCase):
+    """Starts a server with the module and MODULE_ARGS, flushed before each test"""
+    MODULE_ARGS = []
+
+    @classmethod
+    def setUpClass(cls):
+        if shutil.which(SERVER) is None:
+            raise unittest.SkipTest('redis-server not found, set REDIS_SERVER')
+        cls.dir = tempfile.mkdtemp()
+        cls.port = free_port()
+        cls.server = subprocess.Popen(
+            [SERVER, '--port', str(cls.port), '--dir', cls.dir, '--save', '',
+             '--enable-debug-command', 'yes',
+             '--loadmodule', MODULE] + [str(arg) for arg in cls.MODULE_ARGS],
+            stdout=subprocess.DEVNULL)
+        cls.r = redis.Redis(port=cls.port)
+        for _ in range(100):
+            try:
+                cls.r.ping()
+                break
+            except redis.ConnectionError:
+                time.sleep(0.05)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.server.terminate()
+        cls.server.wait()
+        shutil.rmtree(cls.dir, ignore_errors=True)
+
+    def setUp(self):
+        self.r.flushall()
+
+    def pairs(self, key):
+        """bilist.all as {(key1, key2): (value, ttl)}"""
+        return {(k1, k2): (v, ttl) for k1, k2, v, ttl in self.r.execute_command('bilist.all', key)}
+
+
+class RdbTest(ServerTestCase):
+
+    def assertReloaded(self, key):
+        before = self.pairs(key)
+        self.r.execute_command('DEBUG', 'RELOAD')
+        after = self.pairs(key)
+        self.assertEqual(before.keys(), after.keys())
+        for pair, (value, ttl) in before.items():
+            self.assertEqual(after[pair][0], value)
+            if ttl == -1:
+                self.assertEqual(after[pair][1], -1, pair)
+            else:
+                # TTLs are in seconds, the reload may cross a second
+                self.assertNotEqual(after[pair][1], -1, pair)
+                self.assertLessEqual(ttl - after[pair][1], 1, pair)
+        return after
+
+    def test_equal_expire_times(self):
+        # mset gives every pair the same absolute expire time
+        self.r.execute_command('bilist.mset', 'l', 'a', 'x', '1', 100000, 'b', 'x', '2', 100000, 'c', 'x', '3', 100000)
+        after = self.assertReloaded('l')
+        self.assertEqual(len({ttl for value, ttl in after.values()}), 1)
+
+    def test_decreasing_and_missing_expire_times(self):
+        for i, ttl in enumerate([500000, 400000, 0, 300000, 300000, 0, 200000]):
+            self.r.execute_command('bilist.set', 'l', 'k%d' % i, 'p%d' % i, 'v%d' % i, ttl)
+        self.assertReloaded('l')
+
+    def test_front_coded_keys(self):
+        self.r.execute_command('bilist.set', 'l', '', 'empty', 'v', 0)
+        self.r.execute_command('bilist.set', 'l', 'tenant:1:a', '', 'v', 0)
+        self.r.execute_command('bilist.set', 'l', 'tenant:1:ab', 'x\x00y', 'v', 0)
+        self.r.execute_command('bilist.set', 'l', 'tenant:2', 'x\x00y', 'v', 0)
+        self.assertReloaded('l')
+        self.assertEqual(self.r.execute_command('bilist.get2', 'l', 'x\x00y'),
+                         [[b'tenant:1:ab', b'v'], [b'tenant:2', b'v']])
+
+    def test_skip_lists(self):
+        for i in range(200):
+            self.r.execute_command('bilist.set', 'l', 'k%d' % (i % 20), 'p%d' % i, 'v%d' % i, 100000 - i % 3)
+        self.assertReloaded('l')
+        self.assertEqual(self.r.execute_command('bilist.count2', 'l', 'p7'), 1)
+
+    def test_version(self):
+        for i in range(5):
+            self.r.execute_command('bilist.set', 'l', 'k', 'p%d' % (i % 2), 'v%d' % i, 0)
+        self.r.execute_command('bilist.del', 'l', 'k', 'p0')
+        version = self.r.execute_command('bilist.version', 'l')
+        self.assertReloaded('l')
+        self.assertEqual(self.r.execute_command('bilist.version', 'l'), version)
+
+
+class DeferSecondaryRdbTest(RdbTest):
+    MODULE_ARGS = ['defer-secondary', 1, 'compact-entries', 0]
+
+
+class ScanTest(ServerTestCase):
+
+    def scan(self, key, count, between=None):
+        """Every pair of a full scan in order, calling between(pairs) after each page"""
+        cursor, seen = b'0', []
+        while True:
+            cursor, page = self.r.execute_command('bilist.scan', key, cursor, 'COUNT', count)
+            seen += [(k1, k2) for k1, k2, value, ttl in page]
+            if cursor == b'0':
+                return seen
+            if between:
+                between(seen)
+
+    def test_scan_order(self):
+        for i in range(100):
+            self.r.execute_command('bilist.set', 'l', 'k%02d' % (i % 30), 'p%02d' % i, 'v', 0)
+        self.assertEqual(self.scan('l', 7), sorted(self.pairs('l')))
+
+    def test_cursor_survives_writes(self):
+        pipe = self.r.pipeline(transaction=False)
+        for i in range(500):
+            pipe.execute_command('bilist.set', 'l', 'k%03d' % (i // 4), 'p%d' % (i % 4), 'v', 0)
+        pipe.execute()
+        initial = set(self.pairs('l'))
+        kept = set(initial)
+        added = []
+
+        def write(seen):
+            # The pair the cursor points at goes, along with one ahead of it
+            k1, k2 = seen[-1]
+            self.r.execute_command('bilist.del', 'l', k1, k2)
+            ahead = b'k%03d' % min(int(k1[1:]) + 3, 124)
+            self.r.execute_command('bilist.del1', 'l', ahead)
+            kept.difference_update({(k1, k2)}, {pair for pair in kept if pair[0] == ahead})
+            # New pairs both behind and ahead of the cursor
+            for k1 in (b'k%03d' % len(added), b'k%03d' % (124 - len(added))):
+                self.r.execute_command('bilist.set', 'l', k1, 'new', 'v', 0)
+                added.append((k1, b'new'))
+
+        seen = self.scan('l', 9, write)
+        self.assertEqual(seen, sorted(seen))
+        self.assertEqual(len(seen), len(set(seen)))
+        # Pairs there from start to end are returned, the others at most once
+        self.assertLessEqual(kept, set(seen))
+        self.assertLessEqual(set(seen), initial | set(added))
+
+
+class CompactScanTest(ScanTest):
+    MODULE_ARGS = ['compact-entries', 1000]
+
+
+class DelPartnersTest(ServerTestCase):
+
+    def assertIndexes(self, key, model):
+        """Counts, ranks and LIMIT offsets of both indexes agree with model"""
+        for side, command in ((0, '1'), (1, '2')):
+            keys = sorted({pair[side] for pair in model})
+            for k in keys:
+                partners = sorted(pair[1 - side] for pair in model if pair[side] == k)
+                self.assertEqual(self.r.execute_command('bilist.count' + command, key, k), len(partners))
+                for rank, partner in enumerate(partners):
+                    self.assertEqual(self.r.execute_command('bilist.rank' + command, key, k, partner), rank)
+                for offset in range(0, len(partners), 3):
+                    page = self.r.execute_command('bilist.get' + command, key, k, 'LIMIT', offset, 2)
+                    self.assertEqual([partner for partner, value in page], partners[offset:offset + 2])
+
+    def test_spans_after_deletes(self):
+        model = set()
+        pipe = self.r.pipeline(transaction=False)
+        for i in range(400):
+            pair = (b'k%02d' % (i % 23), b'p%02d' % (i * 7 % 31))
+            pipe.execute_command('bilist.set', 'l', pair[0], pair[1], 'v', 0)
+            model.add(pair)
+        pipe.execute()
+
+        for command, k in (('bilist.del1', b'k05'), ('bilist.del2', b'p00'), ('bilist.del1', b'k22'),
+                           ('bilist.del2', b'p17'), ('bilist.del1', b'k00'), ('bilist.del2', b'p30')):
+            side = 0 if command == 'bilist.del1' else 1
+            gone = {pair for pair in model if pair[side] == k}
+            self.assertEqual(self.r.execute_command(command, 'l', k), len(gone))
+            model -= gone
+            self.assertEqual(self.r.execute_command('bilist.count', 'l'), len(model))
+            self.assertIndexes('l', model)
+        self.assertEqual(self.r.execute_command('bilist.del1', 'l', 'k05'), 0)
+
+
+class DeferSecondaryDelPartnersTest(DelPartnersTest):
+    MODULE_ARGS = ['defer-secondary', 1]
+
+
+class CompactDelPartnersTest(DelPartnersTest):
+    MODULE_ARGS = ['compact-entries', 1000]
+
+
+class ReplicationTest(ServerTestCase):
+    """Reads the replication stream through a connection that acts as a replica"""
+
+    def setUp(self):
+        super().setUp()
+        self.r.config_set('repl-diskless-sync', 'no')
+        self.replica = socket.create_connection(('127.0.0.1', self.port))
+        self.replica.sendall(b'*1\r\n$4\r\nSYNC\r\n')
+        self.stream = self.replica.makefile('rb')
+        # Newlines keep the link alive until the RDB payload is ready
+        line = self.stream.readline()
+        while line == b'\n':
+            line = self.stream.readline()
+        self.stream.read(int(line[1:]))
+
+    def tearDown(self):
+        self.stream.close()
+        self.replica.close()
+
+    def read_command(self):
+        line = self.stream.readline()
+        while line == b'\n':
+            line = self.stream.readline()
+        command = []
+        for _ in range(int(line[1:])):
+            length = int(self.stream.readline()[1:])
+            command.append(self.stream.read(length + 2)[:-2])
+        return command
+
+    def replicated(self):
+        """Commands replicated since the last call, up to a marker"""
+        self.r.set('marker', 'x')
+        commands = []
+        while True:
+            command = self.read_command()
+            if command[:2] == [b'SET', b'marker']:
+                return commands
+            if command[0].upper() not in (b'SELECT', b'PING', b'MULTI', b'EXEC'):
+                commands.append(command)
+
+    def test_writes_go_out_as_effects(self):
+        before = int(time.time() * 1000)
+        self.r.execute_command('bilist.set', 'l', 'a', 'b', 'v', 100)
+        self.r.execute_command('bilist.set', 'l', 'a', 'c', 'w', 0)
+        self.r.execute_command('bilist.mset', 'l', 'b', 'c', 'x', 0, 'c', 'd', 'y', 0)
+        self.r.execute_command('bilist.ckey', 'l', 4)
+        self.r.execute_command('bilist.del', 'l', 'a', 'c')
+        after = int(time.time() * 1000)
+
+        commands = self.replicated()
+        self.assertEqual([command[:6] for command in commands[:2]],
+                         [[b'bilist.mset', b'l', b'PXAT', b'a', b'b', b'v'], [b'bilist.mset', b'l', b'PXAT', b'a', b'c', b'w']])
+        self.assertTrue(before + 100000 <= int(commands[0][6]) <= after + 100000)
+        self.assertEqual(commands[1][6], b'0')
+        self.assertEqual(commands[2], [b'bilist.mset', b'l', b'PXAT', b'b', b'c', b'x', b'0', b'c', b'd', b'y', b'0'])
+        self.assertEqual(commands[3][:2], [b'bilist.seed', b'l'])
+        self.assertEqual(len(commands[3]), 5)
+        self.assertEqual(commands[4:], [[b'bilist.del', b'l', b'a', b'c']])
+
+    def test_noops_are_not_replicated(self):
+        self.r.execute_command('bilist.set', 'l', 'a', 'b', 'v', 0)
+        self.replicated()
+
+        self.assertEqual(self.r.execute_command('bilist.del', 'l', 'a', 'x'), 0)
+        self.assertEqual(self.r.execute_command('bilist.mdel', 'l', 'x', 'y', 'z', 'w'), 0)
+        self.assertEqual(self.r.execute_command('bilist.del1', 'l', 'x'), 0)
+        self.assertEqual(self.r.execute_command('bilist.del2', 'l', 'x'), 0)
+        self.assertEqual(self.r.execute_command('bilist.del', 'missing', 'a', 'b'), 0)
+        self.assertEqual(self.r.execute_command('bilist.del1', 'missing', 'a'), 0)
+        for ttl in (-1, 2 ** 62):
+            with self.assertRaises(redis.ResponseError):
+                self.r.execute_command('bilist.set', 'other', 'a', 'b', 'v', ttl)
+        self.assertEqual(self.replicated(), [])
+        self.assertEqual(self.r.exists('missing', 'other'), 0)
+
+    def test_expired_pairs_go_out_as_mdel(self):
+        self.r.execute_command('bilist.set', 'l', 'a', 'b', 'v', 1)
+        self.r.execute_command('bilist.set', 'l', 'a', 'c', 'v', 0)
+        self.replicated()
+
+        deadline = time.time() + 10
+        while self.r.execute_command('bilist.count', 'l') > 1 and time.time() < deadline:
+            time.sleep(0.1)
+        self.assertEqual(self.replicated(), [[b'bilist.mdel', b'l', b'a', b'b']])
+
+        # The key goes with its last pair, replicas delete it on the mdel
+        self.r.execute_command('bilist.set', 'l', 'a', 'c', 'v', 1)
+        self.replicated()
+        while self.r.exists('l') and time.time() < deadline:
+            time.sleep(0.1)
+        self.assertEqual(self.r.exists('l'), 0)
+        self.assertEqual(self.replicated(), [[b'bilist.mdel', b'l', b'a', b'c']])
+
+
+class WalkTest(ServerTestCase):
+
+    def setUp(self):
+        super().setUp()
+        # u1 - a, b   u2 - a, c   u3 - c   u4 - b, c
+        self.r.execute_command('bilist.mset', 'g', 'u1', 'a', 'v', 0, 'u1', 'b', 'v', 0, 'u2', 'a', 'v', 0,
+                               'u2', 'c', 'v', 0, 'u3', 'c', 'v', 0, 'u4', 'b', 'v', 0, 'u4', 'c', 'v', 0)
+
+    def walk(self, *args):
+        return self.r.execute_command('bilist.walk', 'g', *args)
+
+    def test_depth(self):
+        self.assertEqual(self.walk('u1', 'DEPTH', 1), [b'a', b'b'])
+        self.assertEqual(self.walk('u1'), [b'u1', b'u2', b'u4'])
+        self.assertEqual(self.walk('u1', 'DEPTH', 3, 'WITHCOUNTS'), [[b'a', 3], [b'b', 3], [b'c', 2]])
+        self.assertEqual(self.walk('u9'), [])
+        for depth in (0, 9, 'x'):
+            with self.assertRaises(redis.ResponseError):
+                self.walk('u1', 'DEPTH', depth)
+
+    def test_direction(self):
+        self.assertEqual(self.walk('c', 'DIRECTION', 2), [b'a', b'c', b'b'])
+        self.assertEqual(self.walk('c', 'DIRECTION', 2, 'DEPTH', 1), [b'u2', b'u3', b'u4'])
+        with self.assertRaises(redis.ResponseError):
+            self.walk('c', 'DIRECTION', 3)
+
+    def test_withcounts_and_exclude_start(self):
+        self.assertEqual(self.walk('u1', 'WITHCOUNTS'), [[b'u1', 2], [b'u2', 1], [b'u4', 1]])
+        self.assertEqual(self.walk('u1', 'EXCLUDE-START'), [b'u2', b'u4'])
+        self.assertEqual(self.walk('u1', 'WITHCOUNTS', 'EXCLUDE-START'), [[b'u2', 1], [b'u4', 1]])
+        self.assertEqual(self.walk('c', 'DIRECTION', 2, 'WITHCOUNTS'), [[b'c', 3], [b'a', 1], [b'b', 1]])
+        # The start key cannot come back after an odd number of hops
+        self.assertEqual(self.walk('u1', 'DEPTH', 1, 'EXCLUDE-START'), [b'a', b'b'])
+
+    def test_limit(self):
+        self.assertEqual(self.walk('u1', 'LIMIT', 2), [b'u1', b'u2'])
+        self.assertEqual(self.walk('u1', 'LIMIT', 0), [])
+        self.assertEqual(self.walk('u1', 'LIMIT', -1), [b'u1', b'u2', b'u4'])
+        self.assertEqual(self.walk('u1', 'LIMIT', 1, 'EXCLUDE-START'), [b'u2'])
+        # Counts rank the whole last hop before LIMIT applies
+        self.assertEqual(self.walk('c', 'DIRECTION', 2, 'WITHCOUNTS', 'LIMIT', 1), [[b'c', 3]])
+
+    def test_work_bound(self):
+        # Every key1 is paired with every key2, each hop after the first reads all pairs
+        pipe = self.r.pipeline(transaction=False)
+        for i in range(400):
+            args = []
+            for j in range(400):
+                args += ['u%d' % i, 'i%d' % j, 'v', 0]
+            pipe.execute_command('bilist.mset', 'big', *args)
+        pipe.execute()
+        self.assertEqual(len(self.r.execute_command('bilist.walk', 'big', 'u0')), 400)
+        with self.assertRaises(redis.ResponseError):
+            self.r.execute_command('bilist.walk', 'big', 'u0', 'DEPTH', 8)
+
+
+class DefragTest(ServerTestCase):
+
+    def setUp(self):
+        super().setUp()
+        try:
+            self.r.config_set('activedefrag', 'yes')
+        except redis.ResponseError:
+            self.skipTest('active defrag needs a jemalloc build')
+        self.r.config_set('active-defrag-ignore-bytes', '1')
+        self.r.config_set('active-defrag-threshold-lower', '0')
+
+    def tearDown(self):
+        self.r.config_set('activedefrag', 'no')
+
+    def test_defrag_during_writes(self):
+        pairs = 20000
+        pipe = self.r.pipeline(transaction=False)
+        for i in range(pairs):
+            pipe.execute_command('bilist.set', 'l', 'k%05d' % i, 'p%05d' % i, 'v', 0)
+        # Half the pairs go, leaving the slabs half empty
+        for i in range(1, pairs, 2):
+            pipe.execute_command('bilist.del', 'l', 'k%05d' % i, 'p%05d' % i)
+        pipe.execute()
+        fragmented = self.r.memory_usage('l')
+
+        # Overwrite the oldest pairs, the last ones the defrag pass reaches
+        deadline = time.time() + 30
+        while time.time() < deadline:
+            for i in range(0, 400, 2):
+                self.r.execute_command('bilist.set', 'l', 'k%05d' % i, 'p%05d' % i, 'w', 0)
+            if self.r.memory_usage('l') < fragmented * 3 // 4:
+                break
+            time.sleep(0.1)
+        self.assertLess(self.r.memory_usage('l'), fragmented * 3 // 4)
+
+        self.assertEqual(self.r.execute_command('bilist.count', 'l'), pairs // 2)
+        for i in range(0, pairs, 2):
+            value = b'w' if i < 400 else b'v'
+            self.assertEqual(self.r.execute_command('bilist.get', 'l', 'k%05d' % i, 'p%05d' % i), value)
+            self.assertEqual(self.r.execute_command('bilist.get2', 'l', 'p%05d' % i), [[b'k%05d' % i, value]])
+
+
+if __name__ == '__main__':
+    unittest.main()